@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "object.h"
+
+// Builds the object file while the program is compiled, so no assembler source has to
+// be written and parsed again. Jumps to labels that are not placed yet are patched
+// when the code is finished. The debug info is the one the assembler would produce
+// from the listing, which is kept only when it is asked for.
+class BytecodeWriter {
+public:
+    explicit BytecodeWriter(bool has_listing) : has_listing_(has_listing) {
+    }
+
+    void Emit(Command command) {
+        BeginInstruction(command);
+        EndListingLine();
+    }
+
+    void Emit(Command command, double arg) {
+        BeginInstruction(command);
+        code_.push_back(arg);
+        if (has_listing_) {
+            listing_ += ' ';
+            WriteNumber(arg);
+        }
+        EndListingLine();
+    }
+
+    // Pushes the variable in slot, from its register if it has one.
+    void EmitLoad(size_t slot) {
+        size_t reg = FindRegister(slot);
+        if (reg == NO_REGISTER) {
+            Emit(MOV_MEMTOS, static_cast<double>(slot));
+        } else {
+            Emit(static_cast<Command>(MOV_ATOS + reg));
+        }
+    }
+
+    // Pops into the variable in slot, into its register if it has one.
+    void EmitStore(size_t slot) {
+        size_t reg = FindRegister(slot);
+        if (reg == NO_REGISTER) {
+            Emit(MOV_STOMEM, static_cast<double>(slot));
+        } else {
+            Emit(static_cast<Command>(MOV_STOA + reg));
+        }
+    }
+
+    // From now on the variables in slots are kept in ra, rb, rc and rd in this order.
+    // The variables that lose their register have to be written back before.
+    void SetRegisters(const std::vector<size_t>& slots) {
+        register_slots_ = slots;
+        register_slots_.resize(std::min(slots.size(), REGISTERS_COUNT));
+    }
+
+    // Copies the variable in slot from memory to its register.
+    void EmitFill(size_t slot) {
+        Emit(MOV_MEMTOS, static_cast<double>(slot));
+        EmitStore(slot);
+    }
+
+    // Copies the variable in slot from its register back to memory.
+    void EmitSpill(size_t slot) {
+        EmitLoad(slot);
+        Emit(MOV_STOMEM, static_cast<double>(slot));
+    }
+
+    // Jumps and calls to label, which may be placed later.
+    void EmitJump(Command command, size_t label) {
+        BeginInstruction(command);
+        if (label < label_offsets_.size() && label_offsets_[label] != UNDEFINED) {
+            code_.push_back(static_cast<double>(label_offsets_[label]));
+        } else {
+            fixups_.push_back({code_.size(), label});
+            code_.push_back(0);
+        }
+        if (has_listing_) {
+            listing_ += ' ';
+            WriteNumber(static_cast<double>(label));
+        }
+        EndListingLine();
+    }
+
+    void PlaceLabel(size_t label) {
+        if (label >= label_offsets_.size()) {
+            label_offsets_.resize(label + 1, UNDEFINED);
+        }
+        label_offsets_[label] = code_.size();
+        if (has_listing_) {
+            listing_ += "LABEL ";
+            WriteNumber(static_cast<double>(label));
+        }
+        EndListingLine();
+    }
+
+    // Source line of the instructions that follow.
+    void SetLine(size_t line) {
+        source_line_ = static_cast<uint32_t>(line);
+        if (has_listing_) {
+            listing_ += "LINE ";
+            WriteNumber(static_cast<double>(line));
+        }
+        EndListingLine();
+    }
+
+    // Patches the jumps to labels placed after them. Returns -1 and the label in
+    // undefined_label if some jump goes to a label that was never placed.
+    int Finish(ObjectFile* object, size_t* undefined_label) {
+        for (const auto& fixup : fixups_) {
+            if (fixup.label >= label_offsets_.size() || label_offsets_[fixup.label] == UNDEFINED) {
+                *undefined_label = fixup.label;
+                return -1;
+            }
+            code_[fixup.offset] = static_cast<double>(label_offsets_[fixup.label]);
+        }
+        fixups_.clear();
+
+        object->flags = 0;
+        object->code = std::move(code_);
+        object->debug = std::move(debug_);
+        object->symbols.clear();
+        object->relocations.clear();
+        return 0;
+    }
+
+    // Assembler source of the code, empty unless the writer keeps a listing.
+    const std::string& Listing() const {
+        return listing_;
+    }
+
+private:
+    static constexpr size_t UNDEFINED = SIZE_MAX;
+    static constexpr size_t MAX_NUMBER_LENGTH = 32;
+    static constexpr size_t REGISTERS_COUNT = 4;
+    static constexpr size_t NO_REGISTER = SIZE_MAX;
+
+    struct Fixup {
+        size_t offset;
+        size_t label;
+    };
+
+    void BeginInstruction(Command command) {
+        debug_.push_back({code_.size(), asm_line_ + 1, source_line_});
+        code_.emplace_back(command);
+        if (has_listing_) {
+            listing_ += CommandName(command);
+        }
+    }
+
+    size_t FindRegister(size_t slot) const {
+        for (size_t reg = 0; reg < register_slots_.size(); ++reg) {
+            if (register_slots_[reg] == slot) {
+                return reg;
+            }
+        }
+        return NO_REGISTER;
+    }
+
+    void EndListingLine() {
+        ++asm_line_;
+        if (has_listing_) {
+            listing_ += '\n';
+        }
+    }
+
+    // Shortest text that the assembler reads back as exactly the same value.
+    void WriteNumber(double value) {
+        char digits[MAX_NUMBER_LENGTH];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        listing_.append(digits, result.ptr);
+    }
+
+    bool has_listing_;
+    std::vector<double> code_;
+    std::vector<DebugEntry> debug_;
+    std::vector<size_t> label_offsets_;
+    std::vector<Fixup> fixups_;
+    std::vector<size_t> register_slots_;
+    uint32_t asm_line_ = 0;
+    uint32_t source_line_ = 0;
+    std::string listing_;
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode_writer.h"
+#include "expression_evaluation.h"
+#include "statements.h"
+
+// Common subexpression elimination over a run of ASSIGN, SCAN and PRINT statements.
+// Equal subexpressions are one node of the expression DAG, so a value computed once is
+// found by its node until some variable it reads is assigned. The block is walked twice in the same
+// way: the first walk counts how often every value is needed, the second emits the
+// code and keeps the values needed again in temporary memory slots when that saves
+// instructions. A value just assigned to a variable is read back from the variable.
+class CommonSubexpressions {
+public:
+    // Emits the statements from begin to end with var_index_in_memory giving the slots
+    // of the variables. Temporaries get slots of their own from cur_memory_index, the
+    // blocks share them.
+    void CompileBlock(const Statement* begin, const Statement* end,
+                      const std::unordered_map<std::string, size_t>& var_index_in_memory,
+                      size_t* cur_memory_index, BytecodeWriter* out) {
+        var_index_in_memory_ = &var_index_in_memory;
+        cur_memory_index_ = cur_memory_index;
+        out_ = out;
+
+        values_.clear();
+        is_emitting_ = false;
+        WalkBlock(begin, end);
+
+        is_emitting_ = true;
+        next_value_ = 0;
+        WalkBlock(begin, end);
+    }
+
+    // Instructions of all blocks compiled so far that the reuse of values saved.
+    size_t EliminatedCount() const {
+        return expanded_count_ > emitted_count_ ? expanded_count_ - emitted_count_ : 0;
+    }
+
+private:
+    static constexpr size_t NO_SLOT = SIZE_MAX;
+    // Keeping a value costs a DUP and a MOV_STOMEM.
+    static constexpr uint64_t SPILL_COST = 2;
+
+    struct Value {
+        const Expression* node;
+        // Times the value is needed, counted by the first walk. The second walk counts
+        // them down and frees the temporary after the last one.
+        size_t uses = 1;
+        // Set once the value is kept in a temporary or in its variable.
+        size_t slot = NO_SLOT;
+        // The statement that computes the value assigns it to a variable.
+        bool is_assigned = false;
+    };
+
+    void WalkBlock(const Statement* begin, const Statement* end) {
+        available_.clear();
+        readers_.clear();
+        for (const Statement* current = begin; current != end; ++current) {
+            const Statement& statement = *current;
+            first_value_ = is_emitting_ ? next_value_ : values_.size();
+            if (is_emitting_) {
+                out_->SetLine(statement.line);
+            }
+            if (statement.kind == StatementKind::SCAN) {
+                EmitStatement(IN);
+            } else {
+                if (is_emitting_) {
+                    expanded_count_ += ExpandedSize(statement.expression.get());
+                }
+                Walk(statement.expression);
+            }
+
+            if (statement.kind == StatementKind::PRINT) {
+                EmitStatement(OUT);
+                continue;
+            }
+            if (is_emitting_) {
+                out_->EmitStore(statement.slot);
+            }
+            Kill(statement.slot);
+            if (statement.kind == StatementKind::ASSIGN) {
+                KeepAssigned(statement.expression, statement.slot);
+            }
+        }
+
+        // Nothing outlives the block, the next one can use all temporaries again.
+        for (size_t index = 0; is_emitting_ && index < values_.size(); ++index) {
+            auto found = available_.find(values_[index].node);
+            if (found != available_.end() && found->second == index && values_[index].slot != NO_SLOT &&
+                !values_[index].is_assigned) {
+                free_temporaries_.push_back(values_[index].slot);
+            }
+        }
+    }
+
+    void Walk(const std::shared_ptr<Expression>& expr) {
+        if (expr->left_ == nullptr) {
+            EmitLeaf(expr);
+            return;
+        }
+
+        auto found = available_.find(expr.get());
+        if (found != available_.end()) {
+            Value& value = values_[found->second];
+            if (!is_emitting_) {
+                ++value.uses;
+                return;
+            }
+            if (value.slot != NO_SLOT) {
+                EmitRead(value.slot);
+            } else {
+                Recompute(expr);
+            }
+            if (--value.uses == 1 && !value.is_assigned && value.slot != NO_SLOT) {
+                free_temporaries_.push_back(value.slot);
+                available_.erase(found);
+            }
+            return;
+        }
+
+        size_t index = is_emitting_ ? next_value_++ : values_.size();
+        if (!is_emitting_) {
+            values_.push_back({expr.get()});
+        }
+        available_[expr.get()] = index;
+        for (size_t slot : variables_.Find(expr.get(), *var_index_in_memory_)) {
+            readers_[slot].push_back(index);
+        }
+
+        Walk(expr->left_);
+        if (expr->right_ != nullptr) {
+            Walk(expr->right_);
+        }
+        Emit(operation_to_command[std::get<Operation>(expr->expression_)]);
+
+        Value& value = values_[index];
+        if (is_emitting_ && !value.is_assigned &&
+            (value.uses - 1) * (ExpandedSize(expr.get()) - 1) > SPILL_COST) {
+            value.slot = AllocateTemporary();
+            Emit(DUP);
+            Emit(MOV_STOMEM, static_cast<double>(value.slot));
+        }
+    }
+
+    // Emits a value that is needed again but was not kept, reading back the values
+    // inside it that were.
+    void Recompute(const std::shared_ptr<Expression>& expr) {
+        if (expr->left_ == nullptr) {
+            EmitLeaf(expr);
+            return;
+        }
+        auto found = available_.find(expr.get());
+        if (found != available_.end() && values_[found->second].slot != NO_SLOT) {
+            EmitRead(values_[found->second].slot);
+            return;
+        }
+        Recompute(expr->left_);
+        if (expr->right_ != nullptr) {
+            Recompute(expr->right_);
+        }
+        Emit(operation_to_command[std::get<Operation>(expr->expression_)]);
+    }
+
+    // The values that read the variable in slot, or are kept in it, are gone.
+    void Kill(size_t slot) {
+        auto readers = readers_.find(slot);
+        if (readers == readers_.end()) {
+            return;
+        }
+        for (size_t index : readers->second) {
+            const Value& value = values_[index];
+            auto found = available_.find(value.node);
+            if (found == available_.end() || found->second != index) {
+                continue;
+            }
+            if (is_emitting_ && value.slot != NO_SLOT && !value.is_assigned) {
+                free_temporaries_.push_back(value.slot);
+            }
+            available_.erase(found);
+        }
+        readers_.erase(readers);
+    }
+
+    // After slot = expr the value of expr can be read from slot, unless expr reads it.
+    void KeepAssigned(const std::shared_ptr<Expression>& expr, size_t slot) {
+        auto found = available_.find(expr.get());
+        if (found == available_.end() || found->second < first_value_) {
+            return;
+        }
+        Value& value = values_[found->second];
+        if (is_emitting_) {
+            value.slot = slot;
+        } else {
+            value.is_assigned = true;
+        }
+        readers_[slot].push_back(found->second);
+    }
+
+    void EmitLeaf(const std::shared_ptr<Expression>& expr) {
+        if (!is_emitting_) {
+            return;
+        }
+        ++emitted_count_;
+        if (auto constant = std::get_if<Constant>(&expr->expression_)) {
+            ConstantToAsm(*constant, *var_index_in_memory_, out_);
+        } else {
+            VariableToAsm(std::get<Variable>(expr->expression_), *var_index_in_memory_, out_);
+        }
+    }
+
+    // Instructions of the statement itself, which are not part of any value.
+    void EmitStatement(Command command) {
+        if (is_emitting_) {
+            out_->Emit(command);
+        }
+    }
+
+    void EmitRead(size_t slot) {
+        if (is_emitting_) {
+            ++emitted_count_;
+            out_->EmitLoad(slot);
+        }
+    }
+
+    void Emit(Command command) {
+        if (is_emitting_) {
+            ++emitted_count_;
+            out_->Emit(command);
+        }
+    }
+
+    void Emit(Command command, double arg) {
+        if (is_emitting_) {
+            ++emitted_count_;
+            out_->Emit(command, arg);
+        }
+    }
+
+    size_t AllocateTemporary() {
+        if (free_temporaries_.empty()) {
+            return (*cur_memory_index_)++;
+        }
+        size_t slot = free_temporaries_.back();
+        free_temporaries_.pop_back();
+        return slot;
+    }
+
+    // Instructions that compute expr without reusing anything.
+    uint64_t ExpandedSize(const Expression* expr) {
+        if (expr->left_ == nullptr) {
+            return 1;
+        }
+        auto found = expanded_sizes_.find(expr);
+        if (found != expanded_sizes_.end()) {
+            return found->second;
+        }
+        uint64_t size = 1 + ExpandedSize(expr->left_.get());
+        if (expr->right_ != nullptr) {
+            size += ExpandedSize(expr->right_.get());
+        }
+        expanded_sizes_[expr] = size;
+        return size;
+    }
+
+    const std::unordered_map<std::string, size_t>* var_index_in_memory_ = nullptr;
+    size_t* cur_memory_index_ = nullptr;
+    BytecodeWriter* out_ = nullptr;
+    bool is_emitting_ = false;
+
+    std::vector<Value> values_;
+    size_t next_value_ = 0;
+    size_t first_value_ = 0;
+    std::unordered_map<const Expression*, size_t> available_;
+    std::unordered_map<size_t, std::vector<size_t>> readers_;
+    std::vector<size_t> free_temporaries_;
+
+    std::unordered_map<const Expression*, uint64_t> expanded_sizes_;
+    ExpressionVariables variables_;
+    uint64_t expanded_count_ = 0;
+    uint64_t emitted_count_ = 0;
+};
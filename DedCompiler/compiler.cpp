@@ -1,17 +1,53 @@
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <sstream>
 #include <unordered_map>
 
 #include "utils.h"
+#include "bytecode_writer.h"
+#include "common_subexpressions.h"
 #include "expression_evaluation.h"
+#include "ir.h"
+#include "ir_passes.h"
+#include "loop_invariants.h"
+#include "register_allocation.h"
+#include "statements.h"
+#include "build_cache.h"
+
+// Bumped whenever the compiler starts to translate some program differently, the
+// build cache keys depend on it.
+const char* COMPILER_VERSION = "DedCompiler 8";
 
 struct Scope {
-    size_t cur_label = 0;
     size_t cur_memory_index = 0;
     std::unordered_map<std::string, size_t> var_index_in_memory;
+
+    size_t cur_line = 1;
+    size_t counted_pos = 0;
+
+    // Set by -O, which is the default: expressions are simplified before code is emitted,
+    // loop invariants are computed before their loops, the passes over the control flow
+    // graph run, values are reused within basic blocks and loops keep their hottest
+    // variables in registers.
+    bool is_optimized = true;
+    LoopInvariants loop_invariants;
+    PassManager passes;
+    CommonSubexpressions common_subexpressions;
+    RegisterAllocation register_allocation;
 };
 
+// Source line of cur_pos. Statements are parsed front to back, so the newlines
+// are counted only once.
+size_t CurrentLine(const std::string& buffer, size_t cur_pos, Scope* scope) {
+    for (; scope->counted_pos < cur_pos && scope->counted_pos < buffer.size(); ++scope->counted_pos) {
+        if (buffer[scope->counted_pos] == '\n') {
+            ++scope->cur_line;
+        }
+    }
+    return scope->cur_line;
+}
+
 bool IsDefined(const std::string& var, Scope* scope) {
     return (scope->var_index_in_memory.find(var) != scope->var_index_in_memory.end());
 }
@@ -19,7 +55,7 @@ bool IsDefined(const std::string& var, Scope* scope) {
 struct BoolExpression {
     std::string lhs;
     std::string rhs;
-    std::string sign;
+    Command jump;
 };
 
 BoolExpression ParseBoolExpression(const std::string& line) {
@@ -35,18 +71,21 @@ BoolExpression ParseBoolExpression(const std::string& line) {
         exit(0);
     }
     if (line[i] == '=') {
-        expr.sign = "JE";
+        expr.jump = JE;
     } else if (line[i] == '<') {
-        expr.sign = "JL";
+        expr.jump = JL;
     } else if (line[i] == '>') {
-        expr.sign = "JG";
+        expr.jump = JG;
     } else if (line[i] == '!' && line[i + 1] == '=') {
-        expr.sign = "JN";
+        expr.jump = JN;
         if (i + 2 == line.size()) {
             std::cout << "Invalid bool expression: " << line << "\n";
             exit(0);
         }
         ++i;
+    } else {
+        std::cout << "Invalid bool expression: " << line << "\n";
+        exit(0);
     }
     ++i;
     expr.rhs = line.substr(i);
@@ -54,19 +93,50 @@ BoolExpression ParseBoolExpression(const std::string& line) {
 }
 
 
-void Compile(const std::string& buffer, size_t& cur_pos, Scope* scope, std::ostream* out);
+std::vector<Statement> Parse(const std::string& buffer, size_t& cur_pos, Scope* scope);
+
+// Sums and products of many terms are deep in the left operands, so those are walked
+// in a loop, in the order the code reads the variables.
+void CheckVariables(const std::shared_ptr<Expression>& expr, Scope* scope) {
+    std::vector<const Expression*> left_operands;
+    for (const Expression* node = expr.get(); node != nullptr; node = node->left_.get()) {
+        left_operands.push_back(node);
+    }
+    for (auto node = left_operands.rbegin(); node != left_operands.rend(); ++node) {
+        if (auto variable = std::get_if<Variable>(&(*node)->expression_)) {
+            if (!IsDefined(variable->name, scope)) {
+                std::cout << "Undefined variable in expression: " << variable->name << "\n";
+                exit(0);
+            }
+        }
+        if ((*node)->right_ != nullptr) {
+            CheckVariables((*node)->right_, scope);
+        }
+    }
+}
 
-void CompileExpression(const std::string& str, Scope* scope, std::ostream* out) {
+// The variables are checked here, the statement is emitted after later definitions.
+std::shared_ptr<Expression> ParseExpression(const std::string& str, Scope* scope) {
     std::stringstream in{str};
     Tokenizer tokenizer(&in);
     auto expr = StringToExpression(&tokenizer);
+    CheckVariables(expr, scope);
 
-    //SimplifyExpression(expr);
+    if (scope->is_optimized) {
+        SimplifyExpression(expr);
+    }
+    return expr;
+}
 
-    ExpressionToAsm(expr, scope->var_index_in_memory, out);
+// Condition of if and while, with the comparison already checked.
+Condition ParseCondition(const std::string& str, Scope* scope) {
+    auto bool_expr = ParseBoolExpression(str);
+    auto lhs = ParseExpression(bool_expr.lhs, scope);
+    auto rhs = ParseExpression(bool_expr.rhs, scope);
+    return {lhs, rhs, bool_expr.jump};
 }
 
-void CompileDef(const std::string& str, Scope* scope, std::ostream* out) {
+void ParseDef(const std::string& str, Scope* scope) {
     auto parts = ParseLine(str);
     if (parts.size() != 2) {
         std::cout << "Invalid definition: " << str << "\n";
@@ -82,7 +152,7 @@ void CompileDef(const std::string& str, Scope* scope, std::ostream* out) {
     ++scope->cur_memory_index;
 }
 
-void CompileAssign(const std::string& str, Scope* scope, std::ostream* out) {
+Statement ParseAssign(const std::string& str, size_t line, Scope* scope) {
     auto parts = ParseLine(str);
     if (parts.size() != 3) {
         std::cout << "Invalid assignment: " << str << "\n";
@@ -94,11 +164,11 @@ void CompileAssign(const std::string& str, Scope* scope, std::ostream* out) {
         exit(0);
     }
 
-    CompileExpression(parts[2], scope, out);
-    *out << "MOV_STOMEM " << scope->var_index_in_memory[parts[1]] << "\n";
+    auto expr = ParseExpression(parts[2], scope);
+    return {StatementKind::ASSIGN, line, scope->var_index_in_memory[parts[1]], expr};
 }
 
-void CompileScan(const std::string& str, Scope* scope, std::ostream* out) {
+Statement ParseScan(const std::string& str, size_t line, Scope* scope) {
     auto parts = ParseLine(str);
     if (parts.size() != 2) {
         std::cout << "Invalid scan statement: " << str << "\n";
@@ -110,22 +180,21 @@ void CompileScan(const std::string& str, Scope* scope, std::ostream* out) {
         exit(0);
     }
 
-    *out << "IN\n";
-    *out << "MOV_STOMEM " << scope->var_index_in_memory[parts[1]] << "\n";
+    return {StatementKind::SCAN, line, scope->var_index_in_memory[parts[1]], nullptr};
 }
 
-void CompilePrint(const std::string& str, Scope* scope, std::ostream* out) {
+Statement ParsePrint(const std::string& str, size_t line, Scope* scope) {
     auto parts = ParseLine(str);
     if (parts.size() != 2) {
         std::cout << "Invalid print statement: " << str << "\n";
         exit(0);
     }
 
-    CompileExpression(parts[1], scope, out);
-    *out << "OUT\n";
+    auto expr = ParseExpression(parts[1], scope);
+    return {StatementKind::PRINT, line, 0, expr};
 }
 
-void CompileIf(const std::string& buffer, size_t& cur_pos, Scope* scope, std::ostream* out) {
+Statement ParseIf(const std::string& buffer, size_t& cur_pos, size_t source_line, Scope* scope) {
     auto line = ExtractLine(buffer, cur_pos);
     auto parts = ParseLine(line);
     if (parts.size() != 2) {
@@ -140,16 +209,9 @@ void CompileIf(const std::string& buffer, size_t& cur_pos, Scope* scope, std::os
         exit(0);
     }
 
-    auto bool_expr = ParseBoolExpression(parts[1]);
-    CompileExpression(bool_expr.lhs, scope, out);
-    CompileExpression(bool_expr.rhs, scope, out);
-    size_t cur_label = scope->cur_label;
-    *out << bool_expr.sign << " " << cur_label << "\n";
-    *out << "JUMP " << cur_label + 1 << "\n";
-    *out << "LABEL " << cur_label << "\n";
-    scope->cur_label += 2;
-    Compile(buffer, cur_pos, scope, out);
-    *out << "LABEL " << cur_label + 1 << "\n";
+    Statement statement{StatementKind::IF, source_line};
+    statement.condition = ParseCondition(parts[1], scope);
+    statement.body = Parse(buffer, cur_pos, scope);
 
     auto close_brace_line = ExtractLine(buffer, cur_pos);
     auto close_brace_parts = ParseLine(close_brace_line);
@@ -157,9 +219,10 @@ void CompileIf(const std::string& buffer, size_t& cur_pos, Scope* scope, std::os
         std::cout << "Expected '}' after if body: " << close_brace_line << "\n";
         exit(0);
     }
+    return statement;
 }
 
-void CompileWhile(const std::string& buffer, size_t& cur_pos, Scope* scope, std::ostream* out) {
+Statement ParseWhile(const std::string& buffer, size_t& cur_pos, size_t source_line, Scope* scope) {
     auto line = ExtractLine(buffer, cur_pos);
     auto parts = ParseLine(line);
     if (parts.size() != 2) {
@@ -174,20 +237,9 @@ void CompileWhile(const std::string& buffer, size_t& cur_pos, Scope* scope, std:
         exit(0);
     }
 
-    auto bool_expr = ParseBoolExpression(parts[1]);
-
-    size_t cur_label = scope->cur_label;
-    scope->cur_label += 3;
-    *out << "LABEL " << cur_label << "\n";
-    CompileExpression(bool_expr.lhs, scope, out);
-    CompileExpression(bool_expr.rhs, scope, out);
-
-    *out << bool_expr.sign << " " << cur_label + 1 << "\n";
-    *out << "JUMP " << cur_label + 2 << "\n";
-    *out << "LABEL " << cur_label + 1 << "\n";
-    Compile(buffer, cur_pos, scope, out);
-    *out << "JUMP " << cur_label << "\n";
-    *out << "LABEL " << cur_label + 2 << "\n";
+    Statement statement{StatementKind::WHILE, source_line};
+    statement.condition = ParseCondition(parts[1], scope);
+    statement.body = Parse(buffer, cur_pos, scope);
 
     auto close_brace_line = ExtractLine(buffer, cur_pos);
     auto close_brace_parts = ParseLine(close_brace_line);
@@ -195,48 +247,184 @@ void CompileWhile(const std::string& buffer, size_t& cur_pos, Scope* scope, std:
         std::cout << "Expected '}' after while body: " << close_brace_line << "\n";
         exit(0);
     }
+    return statement;
 }
 
-void Compile(const std::string& buffer, size_t& cur_pos, Scope* scope, std::ostream* out) {
+// Statements up to the "}" that closes the block, or up to the end of the program.
+std::vector<Statement> Parse(const std::string& buffer, size_t& cur_pos, Scope* scope) {
+    std::vector<Statement> statements;
     while (cur_pos < buffer.size()) {
         std::string first_part = PeekAtFirstPart(buffer, cur_pos);
         if (first_part.empty()) {
             continue;
         } else if (first_part == "}") {
-            return;
+            return statements;
         }
 
+        size_t source_line = CurrentLine(buffer, cur_pos, scope);
         if (first_part == "def") {
             auto line = ExtractLine(buffer, cur_pos);
-            CompileDef(line, scope, out);
+            ParseDef(line, scope);
         } else if (first_part == "assign") {
             auto line = ExtractLine(buffer, cur_pos);
-            CompileAssign(line, scope, out);
+            statements.push_back(ParseAssign(line, source_line, scope));
         } else if (first_part == "scan") {
             auto line = ExtractLine(buffer, cur_pos);
-            CompileScan(line, scope, out);
+            statements.push_back(ParseScan(line, source_line, scope));
         } else if (first_part == "print") {
             auto line = ExtractLine(buffer, cur_pos);
-            CompilePrint(line, scope, out);
+            statements.push_back(ParsePrint(line, source_line, scope));
         } else if (first_part == "if") {
-            CompileIf(buffer, cur_pos, scope, out);
+            statements.push_back(ParseIf(buffer, cur_pos, source_line, scope));
         } else if (first_part == "while") {
-            CompileWhile(buffer, cur_pos, scope, out);
+            statements.push_back(ParseWhile(buffer, cur_pos, source_line, scope));
         } else {
             std::cout << "Unknown instruction: " << first_part << "\n";
             exit(0);
         }
     }
+    return statements;
+}
+
+// Emits the straight-line statements from begin to end.
+void CompileBlock(const Statement* begin, const Statement* end, Scope* scope, BytecodeWriter* out) {
+    if (scope->is_optimized) {
+        scope->common_subexpressions.CompileBlock(begin, end, scope->var_index_in_memory,
+                                                  &scope->cur_memory_index, out);
+        return;
+    }
+
+    for (const Statement* statement = begin; statement != end; ++statement) {
+        out->SetLine(statement->line);
+        if (statement->kind == StatementKind::SCAN) {
+            out->Emit(IN);
+        } else {
+            ExpressionToAsm(statement->expression, scope->var_index_in_memory, out);
+        }
+        if (statement->kind == StatementKind::PRINT) {
+            out->Emit(OUT);
+        } else {
+            out->EmitStore(statement->slot);
+        }
+    }
+}
+
+void CompileCondition(const Condition& condition, Scope* scope, BytecodeWriter* out) {
+    ExpressionToAsm(condition.lhs, scope->var_index_in_memory, out);
+    ExpressionToAsm(condition.rhs, scope->var_index_in_memory, out);
+}
+
+// Emits the reachable blocks in their order. A block gets a label only when some jump
+// goes to it, and a jump to the block that follows is left out. A branch to the block
+// that follows becomes the inverted jump to the other one. An outermost loop with
+// registers loads them at the end of its preheader and writes them back at the start
+// of its exit.
+void CompileGraph(const ControlFlowGraph& graph, Scope* scope, BytecodeWriter* out) {
+    const auto& blocks = graph.Blocks();
+    std::vector<size_t> layout;
+    for (size_t index = 0; index < blocks.size(); ++index) {
+        if (blocks[index].is_reachable) {
+            layout.push_back(index);
+        }
+    }
+
+    std::vector<size_t> following(blocks.size(), SIZE_MAX);
+    std::vector<bool> is_target(blocks.size(), false);
+    for (size_t i = 0; i < layout.size(); ++i) {
+        const BasicBlock& block = blocks[layout[i]];
+        if (i + 1 < layout.size()) {
+            following[layout[i]] = layout[i + 1];
+        }
+        if (block.exit == BlockExit::BRANCH && block.taken != following[layout[i]]) {
+            is_target[block.taken] = true;
+        }
+        if (block.exit != BlockExit::END && block.next != following[layout[i]]) {
+            is_target[block.next] = true;
+        }
+    }
+
+    const RegisterAllocation::LoopNest* nest = nullptr;
+    for (size_t index : layout) {
+        const BasicBlock& block = blocks[index];
+        if (is_target[index]) {
+            out->PlaceLabel(index);
+        }
+        if (nest != nullptr && index >= nest->exit) {
+            for (size_t slot : nest->stores) {
+                out->EmitSpill(slot);
+            }
+            out->SetRegisters({});
+            nest = nullptr;
+        }
+
+        if (!block.statements.empty()) {
+            CompileBlock(block.statements.data(), block.statements.data() + block.statements.size(), scope, out);
+        }
+        if (scope->is_optimized && scope->register_allocation.FindByPreheader(index) != nullptr) {
+            nest = scope->register_allocation.FindByPreheader(index);
+            out->SetRegisters(nest->registers);
+            for (size_t slot : nest->loads) {
+                out->EmitFill(slot);
+            }
+        }
+
+        if (block.exit == BlockExit::BRANCH) {
+            out->SetLine(block.line);
+            CompileCondition(block.condition, scope, out);
+            if (block.taken == following[index]) {
+                out->EmitJump(InvertCondition(block.condition.jump), block.next);
+            } else if (block.next == following[index]) {
+                out->EmitJump(block.condition.jump, block.taken);
+            } else {
+                out->EmitJump(block.condition.jump, block.taken);
+                out->EmitJump(JUMP, block.next);
+            }
+        } else if (block.exit == BlockExit::JUMP && block.next != following[index]) {
+            out->EmitJump(JUMP, block.next);
+        }
+    }
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cout << "Invalid count of arguments.\nEnter name of input file\n";
-        return 0;
+    const std::string cache_option("--cache=");
+
+    std::string input_name;
+    std::string output_name;
+    std::string cache_directory;
+    bool has_listing = false;
+    bool is_optimized = true;
+    bool print_stats = false;
+    bool is_valid = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "-S") {
+            has_listing = true;
+        } else if (arg == "-O" || arg == "-O0") {
+            is_optimized = arg == "-O";
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (arg == "--cache") {
+            cache_directory = BuildCache::DefaultDirectory();
+        } else if (arg.compare(0, cache_option.size(), cache_option) == 0) {
+            cache_directory = arg.substr(cache_option.size());
+        } else if (input_name.empty()) {
+            input_name = arg;
+        } else {
+            is_valid = false;
+        }
     }
 
-    std::string input_name(argv[1]);
-    std::string output_name("a.asm");
+    if (input_name.empty() || !is_valid) {
+        std::cout << "Invalid count of arguments.\nEnter name of input file [-S] [-O | -O0] "
+                     "[-o output] [--cache[=directory]] [--stats]\n";
+        return 0;
+    }
+    // The object goes straight to the processor, -S writes the assembler listing instead.
+    if (output_name.empty()) {
+        output_name = has_listing ? "a.asm" : "a.o";
+    }
 
     std::string buffer;
     if (ReadFile(input_name, buffer) == -1) {
@@ -244,13 +432,73 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    BuildCache cache(cache_directory);
+    std::string key;
+    if (!cache_directory.empty()) {
+        std::string options = std::string(has_listing ? "-S " : "") + (is_optimized ? "-O" : "-O0");
+        key = BuildCache::MakeKey(COMPILER_VERSION, options, buffer.data(), buffer.size());
+        if (cache.Fetch(key, output_name)) {
+            cache.PrintStats(true, &std::cout);
+            return 0;
+        }
+    }
+
     size_t cur_pos = 0;
     Scope scope;
-    std::stringstream out;
-    Compile(buffer, cur_pos, &scope, &out);
-
-    FILE* output = std::freopen(output_name.data(), "w", stdout);
-    std::cout << out.rdbuf();
-    fclose(output);
+    scope.is_optimized = is_optimized;
+    BytecodeWriter writer(has_listing);
+    auto program = Parse(buffer, cur_pos, &scope);
+    if (is_optimized) {
+        scope.loop_invariants.Hoist(&program, &scope.var_index_in_memory, &scope.cur_memory_index);
+    }
+    ControlFlowGraph graph;
+    graph.Build(&program);
+    if (is_optimized) {
+        scope.passes.Add("constants propagated", ConstantPropagation());
+        scope.passes.Add("unreachable blocks", RemoveUnreachableBlocks);
+        scope.passes.Add("dead stores", RemoveDeadStores);
+        scope.passes.Add("unused variables", RemoveUnusedVariables);
+        scope.passes.Run(&graph, {&scope.var_index_in_memory, &scope.cur_memory_index});
+        scope.register_allocation.Analyze(graph, scope.var_index_in_memory, scope.cur_memory_index);
+    }
+    CompileGraph(graph, &scope, &writer);
+
+    bool is_written = false;
+    if (has_listing) {
+        std::ofstream output(output_name);
+        output << writer.Listing();
+        output.close();
+        is_written = static_cast<bool>(output);
+    } else {
+        ObjectFile object;
+        size_t undefined_label = 0;
+        if (writer.Finish(&object, &undefined_label) == -1) {
+            std::cout << "Jump to undefined label " << undefined_label << "\n";
+            return 0;
+        }
+        is_written = WriteObject(output_name, object) == 0;
+    }
+    if (!is_written) {
+        std::cout << "Can not write " << output_name << "\n";
+        return 0;
+    }
+    if (is_optimized && print_stats) {
+        std::cerr << "Loop invariants: " << scope.loop_invariants.HoistedCount() << " expressions hoisted\n";
+        for (const auto& report : scope.loop_invariants.Reports()) {
+            std::cerr << "    loop at line " << report.line << ": " << report.instructions_after
+                      << " instructions per iteration, " << report.instructions_before << " before\n";
+        }
+        scope.passes.PrintStats(&std::cerr);
+        std::cerr << "Common subexpressions: " << scope.common_subexpressions.EliminatedCount()
+                  << " instructions eliminated\n";
+        std::cerr << "Registers: " << scope.register_allocation.AllocatedCount() << " variables kept in "
+                  << scope.register_allocation.LoopNestsCount() << " loop nests\n";
+    }
+    if (!cache_directory.empty()) {
+        if (cache.Store(key, output_name) == -1) {
+            std::cout << "Can not write build cache " << cache_directory << "\n";
+        }
+        cache.PrintStats(false, &std::cout);
+    }
     return 0;
-}
\ No newline at end of file
+}
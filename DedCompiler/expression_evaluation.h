@@ -1,13 +1,20 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <memory>
 #include <variant>
+#include <vector>
 #include <sstream>
 #include <unordered_map>
 #include <unordered_set>
 
+#include "bytecode_writer.h"
 #include "tokenizer.h"
 
-enum Operation {
+enum class Operation {
     ADD,
     SUB,
     MUL,
@@ -15,19 +22,19 @@ enum Operation {
     SQRT
 };
 
-std::unordered_map<Operation, std::string> operation_to_string = {
-    {ADD, "ADD"},
-    {SUB, "SUB"},
-    {MUL, "MUL"},
-    {DIV, "DIV"},
-    {SQRT, "SQRT"}
+std::unordered_map<Operation, Command> operation_to_command = {
+    {Operation::ADD, ADD},
+    {Operation::SUB, SUB},
+    {Operation::MUL, MUL},
+    {Operation::DIV, DIV},
+    {Operation::SQRT, SQRT}
 };
 
 std::unordered_set<Operation> binary_operations = {
-    ADD,
-    SUB,
-    MUL,
-    DIV
+    Operation::ADD,
+    Operation::SUB,
+    Operation::MUL,
+    Operation::DIV
 };
 
 bool IsBinaryOperation(Operation operation) {
@@ -76,149 +83,213 @@ public:
     ExpressionType expression_;
 };
 
+// Every node is made by the pool, and structurally equal expressions are one node:
+// an operation is looked up by its operands, which are unique nodes already. So an
+// expression is a DAG, equal subexpressions compare equal as pointers, and nodes are
+// never changed once made. They live as long as the pool does.
+class ExpressionPool {
+public:
+    std::shared_ptr<Expression> MakeOperation(Operation operation, const std::shared_ptr<Expression>& left,
+                                              const std::shared_ptr<Expression>& right) {
+        auto& node = operations_[{operation, left.get(), right.get()}];
+        if (node == nullptr) {
+            node = std::make_shared<Expression>(operation, left, right);
+        }
+        return node;
+    }
+
+    std::shared_ptr<Expression> MakeConstant(double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        auto& node = constants_[bits];
+        if (node == nullptr) {
+            node = std::make_shared<Expression>(Constant{value});
+        }
+        return node;
+    }
+
+    std::shared_ptr<Expression> MakeVariable(const std::string& name) {
+        auto& node = variables_[name];
+        if (node == nullptr) {
+            node = std::make_shared<Expression>(Variable{name});
+        }
+        return node;
+    }
+
+private:
+    struct OperationKey {
+        Operation operation;
+        const Expression* left;
+        const Expression* right;
+
+        bool operator==(const OperationKey& other) const {
+            return operation == other.operation && left == other.left && right == other.right;
+        }
+    };
+
+    struct OperationKeyHash {
+        size_t operator()(const OperationKey& key) const {
+            size_t hash = std::hash<const Expression*>()(key.left);
+            hash = hash * 31 + std::hash<const Expression*>()(key.right);
+            return hash * 31 + static_cast<size_t>(key.operation);
+        }
+    };
+
+    std::unordered_map<OperationKey, std::shared_ptr<Expression>, OperationKeyHash> operations_;
+    std::unordered_map<uint64_t, std::shared_ptr<Expression>> constants_;
+    std::unordered_map<std::string, std::shared_ptr<Expression>> variables_;
+};
+
+ExpressionPool expression_pool;
+
 auto operator+(const std::shared_ptr<Expression>& lhs, const std::shared_ptr<Expression>& rhs) {
-    return std::make_shared<Expression>(ADD, lhs, rhs);
+    return expression_pool.MakeOperation(Operation::ADD, lhs, rhs);
 }
 
 auto operator-(const std::shared_ptr<Expression>& lhs, const std::shared_ptr<Expression>& rhs) {
-    return std::make_shared<Expression>(SUB, lhs, rhs);
+    return expression_pool.MakeOperation(Operation::SUB, lhs, rhs);
 }
 
 auto operator*(const std::shared_ptr<Expression>& lhs, const std::shared_ptr<Expression>& rhs) {
-    return std::make_shared<Expression>(MUL, lhs, rhs);
+    return expression_pool.MakeOperation(Operation::MUL, lhs, rhs);
 }
 
 auto operator/(const std::shared_ptr<Expression>& lhs, const std::shared_ptr<Expression>& rhs) {
-    return std::make_shared<Expression>(DIV, lhs, rhs);
+    return expression_pool.MakeOperation(Operation::DIV, lhs, rhs);
 }
 
 auto Sqrt(const std::shared_ptr<Expression>& expr) {
-    return std::make_shared<Expression>(SQRT, expr, nullptr);
+    return expression_pool.MakeOperation(Operation::SQRT, expr, nullptr);
 }
 
 
 
-void SimplifyMulByZero(std::shared_ptr<Expression>& expr) {
-    expr = std::make_shared<Expression>(Constant{0.});
+// The simplifier works bottom-up in one traversal: the operands of a node are simple
+// already when the node itself is looked at, so a few local rules reach the fixpoint.
+// Constants of commutative operations go to the right, so chains like (x+1)+2 fold.
+// Shared nodes are simplified once, the results are remembered per node.
+// The compiler deliberately departs from IEEE 754 here: folding the constants of
+// chains rounds differently, and x+0 gives x even for x = -0. Rules that would turn
+// NaN or infinity into a number, x*0 or x-x, are not applied.
+
+std::unordered_map<const Expression*, std::shared_ptr<Expression>> simplified_expressions;
+
+const double* FindConstant(const std::shared_ptr<Expression>& expr) {
+    auto constant = std::get_if<Constant>(&expr->expression_);
+    return constant != nullptr ? &constant->value : nullptr;
 }
 
-void SimplifyMulByOne(std::shared_ptr<Expression>& expr) {
-    if (expr->left_->expression_.index() == 1) {
-        auto number = std::get<Constant>(expr->left_->expression_).value;
-        if (number == 1.) {
-            expr = expr->right_;
-        } else {
-            expr = expr->left_;
-        }
-    } else {
-        auto number = std::get<Constant>(expr->right_->expression_).value;
-        if (number == 1.) {
-            expr = expr->left_;
-        } else {
-            expr = expr->right_;
-        }
-    }
+bool IsOperation(const std::shared_ptr<Expression>& expr, Operation operation) {
+    auto found = std::get_if<Operation>(&expr->expression_);
+    return found != nullptr && *found == operation;
 }
 
-void SimplifyDivByOne(std::shared_ptr<Expression>& expr) {
-    if (expr->right_->expression_.index() == 1) {
-        auto number = std::get<Constant>(expr->right_->expression_).value;
-        if (number == 1.) {
-            expr = expr->left_;
-        } else {
-            expr = expr->right_;
-        }
+double FoldOperation(Operation operation, double left, double right) {
+    switch (operation) {
+        case Operation::ADD:
+            return left + right;
+        case Operation::SUB:
+            return left - right;
+        case Operation::MUL:
+            return left * right;
+        case Operation::DIV:
+            return left / right;
+        case Operation::SQRT:
+            return std::sqrt(left);
     }
+    return 0;
 }
 
-void SimplifyAddWithZero(std::shared_ptr<Expression>& expr) {
-    if (expr->left_->expression_.index() == 1) {
-        auto number = std::get<Constant>(expr->left_->expression_).value;
-        if (number == 0.) {
-            expr = expr->right_;
-        } else {
-            expr = expr->left_;
-        }
-    } else {
-        auto number = std::get<Constant>(expr->right_->expression_).value;
-        if (number == 0.) {
-            expr = expr->left_;
-        } else {
-            expr = expr->right_;
-        }
+// left+c or left-c with c constant and left simple. Folds the constant of left into c
+// when left is such a sum itself, and drops c when it becomes zero.
+std::shared_ptr<Expression> SimplifySumWithConstant(Operation operation, std::shared_ptr<Expression> left,
+                                                    double right) {
+    double sum = operation == Operation::ADD ? right : -right;
+    if ((IsOperation(left, Operation::ADD) || IsOperation(left, Operation::SUB)) &&
+        FindConstant(left->right_) != nullptr) {
+        double inner = *FindConstant(left->right_);
+        sum += IsOperation(left, Operation::ADD) ? inner : -inner;
+        left = left->left_;
     }
-}
 
-void SimplifyOperationWithConstants(std::shared_ptr<Expression>& expr) {
-    Operation operation = std::get<Operation>(expr->expression_);
-    double left = std::get<Constant>(expr->left_->expression_).value;
-    double right = std::get<Constant>(expr->right_->expression_).value;
-    double result = 0;
-    switch (operation) {
-        case ADD:result = left + right;
-            break;
-        case SUB:result = left - right;
-            break;
-        case MUL:result = left * right;
-            break;
-        case DIV:result = left / right;
-            break;
+    if (sum == 0.) {
+        return left;
     }
-    expr = std::make_shared<Expression>(Constant{result});
+    return expression_pool.MakeOperation(sum > 0. ? Operation::ADD : Operation::SUB, left,
+                                         expression_pool.MakeConstant(sum > 0. ? sum : -sum));
 }
 
-bool Simplify(std::shared_ptr<Expression>& expr) {
-    bool flag = false;
-    if (expr->left_ != nullptr) {
-        flag |= Simplify(expr->left_);
+// left*c with c constant and left simple.
+std::shared_ptr<Expression> SimplifyProductWithConstant(std::shared_ptr<Expression> left, double right) {
+    double product = right;
+    if (IsOperation(left, Operation::MUL) && FindConstant(left->right_) != nullptr) {
+        product *= *FindConstant(left->right_);
+        left = left->left_;
     }
-    if (expr->right_ != nullptr) {
-        flag |= Simplify(expr->right_);
+
+    if (product == 1.) {
+        return left;
     }
+    return expression_pool.MakeOperation(Operation::MUL, left, expression_pool.MakeConstant(product));
+}
 
-    if (expr->left_ != nullptr && expr->right_ != nullptr) {
-        if (expr->left_->expression_.index() == 1 && expr->right_->expression_.index() == 1) {
-            SimplifyOperationWithConstants(expr);
-            return true;
+std::shared_ptr<Expression> SimplifyOperation(Operation operation, std::shared_ptr<Expression> left,
+                                              std::shared_ptr<Expression> right) {
+    const double* left_constant = FindConstant(left);
+    if (!IsBinaryOperation(operation)) {
+        if (left_constant != nullptr) {
+            return expression_pool.MakeConstant(FoldOperation(operation, *left_constant, 0));
         }
+        return expression_pool.MakeOperation(operation, left, nullptr);
+    }
 
-        Operation operation = std::get<Operation>(expr->expression_);
-        const double INF = 1e18;
-        double left = INF;
-        double right = INF;
-        if (expr->left_->expression_.index() == 1) {
-            left = std::get<Constant>(expr->left_->expression_).value;
-        }
-        if (expr->right_->expression_.index() == 1) {
-            right = std::get<Constant>(expr->right_->expression_).value;
+    const double* right_constant = FindConstant(right);
+    if (left_constant != nullptr && right_constant != nullptr) {
+        return expression_pool.MakeConstant(FoldOperation(operation, *left_constant, *right_constant));
+    }
+    if (left_constant != nullptr && (operation == Operation::ADD || operation == Operation::MUL)) {
+        std::swap(left, right);
+        std::swap(left_constant, right_constant);
+    }
+
+    if (right_constant != nullptr && (operation == Operation::ADD || operation == Operation::SUB)) {
+        return SimplifySumWithConstant(operation, left, *right_constant);
+    } else if (right_constant != nullptr && operation == Operation::MUL) {
+        return SimplifyProductWithConstant(left, *right_constant);
+    } else if (right_constant != nullptr && operation == Operation::DIV && *right_constant == 1.) {
+        return left;
+    }
+    return expression_pool.MakeOperation(operation, left, right);
+}
+
+// Sums and products of many terms are deep in the left operands, so those are walked
+// in a loop and simplified from the innermost one out.
+std::shared_ptr<Expression> Simplified(const std::shared_ptr<Expression>& expr) {
+    std::vector<const Expression*> left_operands;
+    std::shared_ptr<Expression> simplified;
+    for (const auto* node = &expr;; node = &(*node)->left_) {
+        if (*node == nullptr || (*node)->left_ == nullptr) {
+            simplified = *node;
+            break;
         }
-        if (operation == MUL) {
-            if (left == 1. || right == 1.) {
-                SimplifyMulByOne(expr);
-                return true;
-            }
-
-            if (left == 0. || right == 0.) {
-                SimplifyMulByZero(expr);
-                return true;
-            }
-        } else if (operation == DIV) {
-            if (right == 1.) {
-                SimplifyDivByOne(expr);
-                return true;
-            }
-        } else if (operation == ADD) {
-            if (left == 0. || right == 0) {
-                SimplifyAddWithZero(expr);
-                return true;
-            }
+        auto found = simplified_expressions.find(node->get());
+        if (found != simplified_expressions.end()) {
+            simplified = found->second;
+            break;
         }
+        left_operands.push_back(node->get());
+    }
+
+    for (auto node = left_operands.rbegin(); node != left_operands.rend(); ++node) {
+        simplified = SimplifyOperation(std::get<Operation>((*node)->expression_), simplified,
+                                       Simplified((*node)->right_));
+        simplified_expressions.emplace(*node, simplified);
     }
-    return flag;
+    return simplified;
 }
 
 void SimplifyExpression(std::shared_ptr<Expression>& expr) {
-    while (Simplify(expr)) {}
+    expr = Simplified(expr);
 }
 
 
@@ -226,47 +297,47 @@ void SimplifyExpression(std::shared_ptr<Expression>& expr) {
 
 void ExpressionToAsm(const std::shared_ptr<Expression>& expr,
                      const std::unordered_map<std::string, size_t>& var_index_in_memory,
-                     std::ostream* out);
+                     BytecodeWriter* out);
 
 void BinaryOperationToAsm(const std::shared_ptr<Expression>& expr,
                           const std::unordered_map<std::string, size_t>& var_index_in_memory,
-                          std::ostream* out) {
+                          BytecodeWriter* out) {
     ExpressionToAsm(expr->left_, var_index_in_memory, out);
     ExpressionToAsm(expr->right_, var_index_in_memory, out);
 
     Operation operation = std::get<Operation>(expr->expression_);
-    *out << operation_to_string[operation] << "\n";
+    out->Emit(operation_to_command[operation]);
 }
 
 void UnaryOperationToAsm(const std::shared_ptr<Expression>& expr,
                          const std::unordered_map<std::string, size_t>& var_index_in_memory,
-                         std::ostream* out) {
+                         BytecodeWriter* out) {
     ExpressionToAsm(expr->left_, var_index_in_memory, out);
     Operation operation = std::get<Operation>(expr->expression_);
-    *out << operation_to_string[operation] << "\n";
+    out->Emit(operation_to_command[operation]);
 }
 
 void ConstantToAsm(Constant constant,
                    const std::unordered_map<std::string, size_t>& var_index_in_memory,
-                   std::ostream* out) {
-    *out << "PUSH " << constant.value << "\n";
+                   BytecodeWriter* out) {
+    out->Emit(PUSH, constant.value);
 }
 
 void VariableToAsm(Variable variable,
                    const std::unordered_map<std::string, size_t>& var_index_in_memory,
-                   std::ostream* out) {
+                   BytecodeWriter* out) {
     auto found = var_index_in_memory.find(variable.name);
     if (found == var_index_in_memory.end()) {
         std::cout << "Undefined variable in expression: " << variable.name << "\n";
         exit(0);
     }
 
-    *out << "MOV_MEMTOS " << found->second << "\n";
+    out->EmitLoad(found->second);
 }
 
 void ExpressionToAsm(const std::shared_ptr<Expression>& expr,
                      const std::unordered_map<std::string, size_t>& var_index_in_memory,
-                     std::ostream* out) {
+                     BytecodeWriter* out) {
     int type = expr->expression_.index();
     if (type == 0) {  // Operation
         Operation operation = std::get<Operation>(expr->expression_);
@@ -301,7 +372,7 @@ std::shared_ptr<Expression> FactorToExpression(Tokenizer* tokenizer) {
         tokenizer->Next();
         auto constant = std::get<ConstantToken>(token);
         auto value = static_cast<double>(constant.number);
-        return std::make_shared<Expression>(Constant{value});
+        return expression_pool.MakeConstant(value);
     } else if (token.index() == 3) {  // SymbolToken
         tokenizer->Next();
         auto name = std::get<SymbolToken>(token).symbol;
@@ -310,17 +381,16 @@ std::shared_ptr<Expression> FactorToExpression(Tokenizer* tokenizer) {
         Operation operation;
         Variable variable;
         if (name == "sqrt") {
-            operation = SQRT;
+            operation = Operation::SQRT;
         } else {
             is_variable = true;
             variable.name = name;
         }
 
         if (is_variable) {
-            return std::make_shared<Expression>(variable);
+            return expression_pool.MakeVariable(variable.name);
         } else {
-            auto result =
-                std::make_shared<Expression>(operation, StringToExpression(tokenizer), nullptr);
+            auto result = expression_pool.MakeOperation(operation, StringToExpression(tokenizer), nullptr);
             tokenizer->Next();
             return result;
         }
@@ -333,13 +403,13 @@ std::shared_ptr<Expression> SummandToExpression(Tokenizer* tokenizer) {
         tokenizer->GetToken() == Token{OperationToken{'/'}})) {
         Operation operation;
         if (tokenizer->GetToken() == Token{OperationToken{'*'}}) {
-            operation = MUL;
+            operation = Operation::MUL;
         } else {
-            operation = DIV;
+            operation = Operation::DIV;
         }
 
         tokenizer->Next();
-        if (operation == MUL) {
+        if (operation == Operation::MUL) {
             factor = factor * FactorToExpression(tokenizer);
         } else {
             factor = factor / FactorToExpression(tokenizer);
@@ -357,13 +427,13 @@ std::shared_ptr<Expression> StringToExpression(Tokenizer* tokenizer) {
         tokenizer->GetToken() == Token{OperationToken{'-'}})) {
         Operation operation;
         if (tokenizer->GetToken() == Token{OperationToken{'+'}}) {
-            operation = ADD;
+            operation = Operation::ADD;
         } else {
-            operation = SUB;
+            operation = Operation::SUB;
         }
 
         tokenizer->Next();
-        if (operation == ADD) {
+        if (operation == Operation::ADD) {
             summand = summand + SummandToExpression(tokenizer);
         } else {
             summand = summand - SummandToExpression(tokenizer);
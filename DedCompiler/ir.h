@@ -0,0 +1,253 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "statements.h"
+
+enum class BlockExit {
+    // The program ends after the block.
+    END,
+    // Goes on at next.
+    JUMP,
+    // Goes on at taken when the condition holds and at next otherwise.
+    BRANCH
+};
+
+// A straight-line run of ASSIGN, SCAN and PRINT statements and the jump that ends it.
+struct BasicBlock {
+    std::vector<Statement> statements;
+    BlockExit exit = BlockExit::END;
+    Condition condition;
+    // Source line of the condition.
+    size_t line = 0;
+    size_t taken = 0;
+    size_t next = 0;
+    // Number of while loops around the block.
+    size_t loop_depth = 0;
+    // Cleared by the passes for the blocks no jump can reach, which are not emitted.
+    bool is_reachable = true;
+};
+
+// A while loop, rotated so the condition is checked at its bottom. The preheader jumps
+// to the header, which checks the condition and goes back to the body or on to the
+// exit. The blocks of the loop are the ones from the body up to the exit, the header
+// is the last of them.
+struct Loop {
+    size_t preheader;
+    size_t body;
+    size_t header;
+    size_t exit;
+    // Number of while loops around the loop.
+    size_t depth;
+};
+
+// The program as a control flow graph. The blocks are kept in the order of the source,
+// which is also the order they are emitted in, so a jump to the block that follows is
+// left out and a loop is a range of blocks.
+class ControlFlowGraph {
+public:
+    // Moves the statements of program into the blocks.
+    void Build(std::vector<Statement>* program) {
+        blocks_.clear();
+        loops_.clear();
+        Lower(program, NewBlock(0), 0);
+    }
+
+    std::vector<BasicBlock>& Blocks() {
+        return blocks_;
+    }
+
+    const std::vector<BasicBlock>& Blocks() const {
+        return blocks_;
+    }
+
+    // Inner loops come before the loops around them.
+    const std::vector<Loop>& Loops() const {
+        return loops_;
+    }
+
+    // The blocks the one with index can go on to.
+    std::vector<size_t> Successors(size_t index) const {
+        const BasicBlock& block = blocks_[index];
+        if (block.exit == BlockExit::BRANCH) {
+            return {block.taken, block.next};
+        } else if (block.exit == BlockExit::JUMP) {
+            return {block.next};
+        }
+        return {};
+    }
+
+    // The reachable blocks that go on to every block.
+    std::vector<std::vector<size_t>> Predecessors() const {
+        std::vector<std::vector<size_t>> predecessors(blocks_.size());
+        for (size_t index = 0; index < blocks_.size(); ++index) {
+            if (!blocks_[index].is_reachable) {
+                continue;
+            }
+            for (size_t successor : Successors(index)) {
+                predecessors[successor].push_back(index);
+            }
+        }
+        return predecessors;
+    }
+
+private:
+    size_t NewBlock(size_t loop_depth) {
+        blocks_.emplace_back();
+        blocks_.back().loop_depth = loop_depth;
+        return blocks_.size() - 1;
+    }
+
+    void SetJump(size_t from, size_t to) {
+        blocks_[from].exit = BlockExit::JUMP;
+        blocks_[from].next = to;
+    }
+
+    void SetBranch(size_t from, Statement* statement, size_t taken, size_t next) {
+        BasicBlock& block = blocks_[from];
+        block.exit = BlockExit::BRANCH;
+        block.condition = std::move(statement->condition);
+        block.line = statement->line;
+        block.taken = taken;
+        block.next = next;
+    }
+
+    // Appends statements to the block current, returns the block the code after them goes to.
+    size_t Lower(std::vector<Statement>* statements, size_t current, size_t depth) {
+        for (auto& statement : *statements) {
+            if (statement.kind == StatementKind::IF) {
+                size_t body = NewBlock(depth);
+                size_t body_end = Lower(&statement.body, body, depth);
+                size_t join = NewBlock(depth);
+                SetBranch(current, &statement, body, join);
+                SetJump(body_end, join);
+                current = join;
+            } else if (statement.kind == StatementKind::WHILE) {
+                size_t body = NewBlock(depth + 1);
+                size_t body_end = Lower(&statement.body, body, depth + 1);
+                size_t header = NewBlock(depth + 1);
+                size_t exit = NewBlock(depth);
+                SetJump(current, header);
+                SetBranch(header, &statement, body, exit);
+                SetJump(body_end, header);
+                loops_.push_back({current, body, header, exit, depth});
+                current = exit;
+            } else {
+                blocks_[current].statements.push_back(std::move(statement));
+            }
+        }
+        statements->clear();
+        return current;
+    }
+
+    std::vector<BasicBlock> blocks_;
+    std::vector<Loop> loops_;
+};
+
+// Variables live at the start and at the end of every reachable block, by slot. An
+// assignment to a variable that is not live reads nothing, so a chain of assignments
+// that ends in no output is dead as a whole.
+class Liveness {
+public:
+    void Compute(const ControlFlowGraph& graph,
+                 const std::unordered_map<std::string, size_t>& var_index_in_memory, size_t variables_count) {
+        const auto& blocks = graph.Blocks();
+        live_in_.assign(blocks.size(), std::vector<bool>(variables_count, false));
+        live_out_.assign(blocks.size(), std::vector<bool>(variables_count, false));
+
+        // The last blocks are taken first, they are mostly the successors. A block is
+        // taken again when the variables live at the start of a successor change.
+        auto predecessors = graph.Predecessors();
+        std::vector<size_t> worklist;
+        std::vector<bool> is_queued(blocks.size(), false);
+        for (size_t index = 0; index < blocks.size(); ++index) {
+            if (blocks[index].is_reachable) {
+                worklist.push_back(index);
+                is_queued[index] = true;
+            }
+        }
+        while (!worklist.empty()) {
+            size_t index = worklist.back();
+            worklist.pop_back();
+            is_queued[index] = false;
+
+            std::vector<bool>& live_out = live_out_[index];
+            for (size_t successor : graph.Successors(index)) {
+                Merge(live_in_[successor], &live_out);
+            }
+            std::vector<bool> live = live_out;
+            LiveBefore(blocks[index], var_index_in_memory, &live);
+            if (live == live_in_[index]) {
+                continue;
+            }
+            live_in_[index] = std::move(live);
+            for (size_t predecessor : predecessors[index]) {
+                if (!is_queued[predecessor]) {
+                    worklist.push_back(predecessor);
+                    is_queued[predecessor] = true;
+                }
+            }
+        }
+    }
+
+    const std::vector<bool>& LiveIn(size_t block) const {
+        return live_in_[block];
+    }
+
+    const std::vector<bool>& LiveOut(size_t block) const {
+        return live_out_[block];
+    }
+
+    // Turns live, the variables live after the block, into the ones live at its start.
+    void LiveBefore(const BasicBlock& block, const std::unordered_map<std::string, size_t>& var_index_in_memory,
+                    std::vector<bool>* live) {
+        LiveBeforeExit(block, var_index_in_memory, live);
+        for (auto statement = block.statements.rbegin(); statement != block.statements.rend(); ++statement) {
+            LiveBefore(*statement, var_index_in_memory, live);
+        }
+    }
+
+    // Adds the variables the condition that ends the block reads.
+    void LiveBeforeExit(const BasicBlock& block, const std::unordered_map<std::string, size_t>& var_index_in_memory,
+                        std::vector<bool>* live) {
+        if (block.exit == BlockExit::BRANCH) {
+            AddReads(block.condition.lhs.get(), var_index_in_memory, live);
+            AddReads(block.condition.rhs.get(), var_index_in_memory, live);
+        }
+    }
+
+    void LiveBefore(const Statement& statement, const std::unordered_map<std::string, size_t>& var_index_in_memory,
+                    std::vector<bool>* live) {
+        if (statement.kind == StatementKind::ASSIGN && !(*live)[statement.slot]) {
+            return;
+        }
+        if (statement.kind != StatementKind::PRINT) {
+            (*live)[statement.slot] = false;
+        }
+        if (statement.expression != nullptr) {
+            AddReads(statement.expression.get(), var_index_in_memory, live);
+        }
+    }
+
+private:
+    void AddReads(const Expression* expr, const std::unordered_map<std::string, size_t>& var_index_in_memory,
+                  std::vector<bool>* live) {
+        for (size_t slot : variables_.Find(expr, var_index_in_memory)) {
+            (*live)[slot] = true;
+        }
+    }
+
+    static void Merge(const std::vector<bool>& from, std::vector<bool>* to) {
+        for (size_t slot = 0; slot < from.size(); ++slot) {
+            if (from[slot]) {
+                (*to)[slot] = true;
+            }
+        }
+    }
+
+    std::vector<std::vector<bool>> live_in_;
+    std::vector<std::vector<bool>> live_out_;
+    ExpressionVariables variables_;
+};
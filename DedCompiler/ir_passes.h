@@ -0,0 +1,431 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expression_evaluation.h"
+#include "ir.h"
+
+// The variables of the program: the slots of their names and the number of slots.
+struct ProgramVariables {
+    std::unordered_map<std::string, size_t>* var_index_in_memory;
+    size_t* cur_memory_index;
+};
+
+// Runs the passes over the graph again and again until none of them changes anything,
+// and counts the changes of every pass.
+class PassManager {
+public:
+    // A pass returns the number of changes it made.
+    using Pass = std::function<size_t(ControlFlowGraph*, const ProgramVariables&)>;
+
+    void Add(std::string name, Pass pass) {
+        passes_.push_back({std::move(name), std::move(pass), 0});
+    }
+
+    void Run(ControlFlowGraph* graph, const ProgramVariables& variables) {
+        for (size_t round = 0; round < MAX_ROUNDS; ++round) {
+            bool is_changed = false;
+            for (auto& pass : passes_) {
+                size_t changes = pass.run(graph, variables);
+                pass.changes += changes;
+                is_changed |= changes != 0;
+            }
+            if (!is_changed) {
+                break;
+            }
+        }
+    }
+
+    void PrintStats(std::ostream* out) const {
+        *out << "IR passes:";
+        for (size_t i = 0; i < passes_.size(); ++i) {
+            *out << (i == 0 ? " " : ", ") << passes_[i].name << " " << passes_[i].changes;
+        }
+        *out << "\n";
+    }
+
+private:
+    // Every round that changes something removes a statement, a block or a variable, or
+    // makes a value constant, so this is reached only by very long chains of those.
+    static constexpr size_t MAX_ROUNDS = 16;
+
+    struct NamedPass {
+        std::string name;
+        Pass run;
+        size_t changes;
+    };
+
+    std::vector<NamedPass> passes_;
+};
+
+// Forward dataflow of the values of the variables. A variable that has the same
+// constant value on every path to a statement is replaced by the constant there and the
+// expression is simplified again. A condition that becomes constant turns its branch
+// into a jump. Counts the expressions and conditions that changed.
+class ConstantPropagation {
+public:
+    size_t operator()(ControlFlowGraph* graph, const ProgramVariables& variables) {
+        var_index_in_memory_ = variables.var_index_in_memory;
+        // The slots change when unused variables are removed.
+        variables_.Clear();
+        auto& blocks = graph->Blocks();
+        auto predecessors = graph->Predecessors();
+        // The memory the program starts with is not known.
+        std::vector<Value> entry(*variables.cur_memory_index, Value{VARYING, 0});
+        std::vector<std::vector<Value>> values_out(blocks.size());
+
+        // The first blocks are taken first. A block is taken again when the values at
+        // the end of a predecessor change.
+        std::vector<size_t> worklist;
+        std::vector<bool> is_queued(blocks.size(), false);
+        for (size_t index = blocks.size(); index-- > 0;) {
+            if (blocks[index].is_reachable) {
+                worklist.push_back(index);
+                is_queued[index] = true;
+            }
+        }
+        while (!worklist.empty()) {
+            size_t index = worklist.back();
+            worklist.pop_back();
+            is_queued[index] = false;
+
+            std::vector<Value> values = ValuesIn(index, entry, predecessors[index], values_out);
+            for (auto& statement : blocks[index].statements) {
+                Transfer(statement, &values, nullptr);
+            }
+            // Simplifying rewrites the expressions, so the transfer is not known to be
+            // monotone; the values only ever go down from the ones of the last visit,
+            // which ends the loop.
+            if (!values_out[index].empty()) {
+                for (size_t slot = 0; slot < values.size(); ++slot) {
+                    Meet(values_out[index][slot], &values[slot]);
+                }
+            }
+            if (values == values_out[index]) {
+                continue;
+            }
+            values_out[index] = std::move(values);
+            for (size_t successor : graph->Successors(index)) {
+                if (!is_queued[successor]) {
+                    worklist.push_back(successor);
+                    is_queued[successor] = true;
+                }
+            }
+        }
+
+        size_t changes = 0;
+        for (size_t index = 0; index < blocks.size(); ++index) {
+            BasicBlock& block = blocks[index];
+            if (!block.is_reachable) {
+                continue;
+            }
+            std::vector<Value> values = ValuesIn(index, entry, predecessors[index], values_out);
+            for (auto& statement : block.statements) {
+                Transfer(statement, &values, &changes);
+            }
+            if (block.exit == BlockExit::BRANCH) {
+                changes += Rewrite(&block.condition.lhs, values);
+                changes += Rewrite(&block.condition.rhs, values);
+                FoldBranch(&block);
+            }
+        }
+        return changes;
+    }
+
+private:
+    enum Kind {
+        // No path to here sets the variable yet.
+        UNKNOWN,
+        CONSTANT,
+        VARYING
+    };
+
+    struct Value {
+        Kind kind;
+        double constant;
+
+        bool operator==(const Value& other) const {
+            return kind == other.kind && (kind != CONSTANT || IsSame(constant, other.constant));
+        }
+
+        bool operator!=(const Value& other) const {
+            return !(*this == other);
+        }
+    };
+
+    // Bitwise, so 0 and -0 differ and NaN is one value.
+    static bool IsSame(double lhs, double rhs) {
+        return std::memcmp(&lhs, &rhs, sizeof(double)) == 0;
+    }
+
+    static std::vector<Value> ValuesIn(size_t index, const std::vector<Value>& entry,
+                                       const std::vector<size_t>& predecessors,
+                                       const std::vector<std::vector<Value>>& values_out) {
+        if (index == 0) {
+            return entry;
+        }
+        std::vector<Value> values(entry.size(), Value{UNKNOWN, 0});
+        for (size_t predecessor : predecessors) {
+            const auto& from = values_out[predecessor];
+            for (size_t slot = 0; slot < from.size(); ++slot) {
+                Meet(from[slot], &values[slot]);
+            }
+        }
+        return values;
+    }
+
+    static void Meet(const Value& from, Value* to) {
+        if (from.kind == UNKNOWN || to->kind == VARYING) {
+            return;
+        }
+        if (to->kind == UNKNOWN) {
+            *to = from;
+        } else if (from.kind == VARYING || !IsSame(from.constant, to->constant)) {
+            to->kind = VARYING;
+        }
+    }
+
+    // Updates values after the statement. Rewrites its expression when changes is set.
+    void Transfer(Statement& statement, std::vector<Value>* values, size_t* changes) {
+        if (statement.kind == StatementKind::SCAN) {
+            (*values)[statement.slot] = {VARYING, 0};
+            return;
+        }
+
+        auto expr = statement.expression;
+        if (changes != nullptr) {
+            *changes += Rewrite(&statement.expression, *values);
+            expr = statement.expression;
+        } else {
+            Rewrite(&expr, *values);
+        }
+        if (statement.kind == StatementKind::ASSIGN) {
+            const double* constant = FindConstant(expr);
+            (*values)[statement.slot] = constant != nullptr ? Value{CONSTANT, *constant} : Value{VARYING, 0};
+        }
+    }
+
+    // Returns 1 if expr reads a variable of constant value, which is then substituted.
+    size_t Rewrite(std::shared_ptr<Expression>* expr, const std::vector<Value>& values) {
+        bool has_constants = false;
+        for (size_t slot : variables_.Find(expr->get(), *var_index_in_memory_)) {
+            has_constants |= values[slot].kind == CONSTANT;
+        }
+        if (!has_constants) {
+            return 0;
+        }
+        values_ = &values;
+        substituted_.clear();
+        *expr = Substituted(*expr);
+        return 1;
+    }
+
+    // Like Simplified, walks the left operands in a loop.
+    std::shared_ptr<Expression> Substituted(const std::shared_ptr<Expression>& expr) {
+        std::vector<const std::shared_ptr<Expression>*> left_operands;
+        std::shared_ptr<Expression> result;
+        for (const auto* node = &expr;; node = &(*node)->left_) {
+            if ((*node)->left_ == nullptr) {
+                result = SubstitutedLeaf(*node);
+                break;
+            }
+            auto found = substituted_.find(node->get());
+            if (found != substituted_.end()) {
+                result = found->second;
+                break;
+            }
+            left_operands.push_back(node);
+        }
+
+        for (auto node = left_operands.rbegin(); node != left_operands.rend(); ++node) {
+            const auto& operation = **node;
+            auto right = operation->right_ != nullptr ? Substituted(operation->right_) : nullptr;
+            if (result != operation->left_ || right != operation->right_) {
+                result = SimplifyOperation(std::get<Operation>(operation->expression_), result, right);
+            } else {
+                result = operation;
+            }
+            substituted_.emplace(operation.get(), result);
+        }
+        return result;
+    }
+
+    std::shared_ptr<Expression> SubstitutedLeaf(const std::shared_ptr<Expression>& expr) {
+        auto variable = std::get_if<Variable>(&expr->expression_);
+        if (variable == nullptr) {
+            return expr;
+        }
+        const Value& value = (*values_)[var_index_in_memory_->at(variable->name)];
+        return value.kind == CONSTANT ? expression_pool.MakeConstant(value.constant) : expr;
+    }
+
+    static void FoldBranch(BasicBlock* block) {
+        const double* lhs = FindConstant(block->condition.lhs);
+        const double* rhs = FindConstant(block->condition.rhs);
+        if (lhs == nullptr || rhs == nullptr) {
+            return;
+        }
+        bool holds = false;
+        switch (block->condition.jump) {
+            case JE:
+                holds = *lhs == *rhs;
+                break;
+            case JN:
+                holds = *lhs != *rhs;
+                break;
+            case JL:
+                holds = *lhs < *rhs;
+                break;
+            case JG:
+                holds = *lhs > *rhs;
+                break;
+            default:
+                return;
+        }
+        block->exit = BlockExit::JUMP;
+        if (holds) {
+            block->next = block->taken;
+        }
+        block->condition = {};
+    }
+
+    const std::unordered_map<std::string, size_t>* var_index_in_memory_ = nullptr;
+    ExpressionVariables variables_;
+    const std::vector<Value>* values_ = nullptr;
+    std::unordered_map<const Expression*, std::shared_ptr<Expression>> substituted_;
+};
+
+// Marks the blocks no path from the first one reaches and drops their statements.
+// Counts the blocks removed.
+inline size_t RemoveUnreachableBlocks(ControlFlowGraph* graph, const ProgramVariables&) {
+    auto& blocks = graph->Blocks();
+    std::vector<bool> is_reached(blocks.size(), false);
+    std::vector<size_t> stack = {0};
+    is_reached[0] = true;
+    while (!stack.empty()) {
+        size_t index = stack.back();
+        stack.pop_back();
+        for (size_t successor : graph->Successors(index)) {
+            if (!is_reached[successor]) {
+                is_reached[successor] = true;
+                stack.push_back(successor);
+            }
+        }
+    }
+
+    size_t removed_count = 0;
+    for (size_t index = 0; index < blocks.size(); ++index) {
+        if (blocks[index].is_reachable && !is_reached[index]) {
+            blocks[index].is_reachable = false;
+            blocks[index].statements.clear();
+            ++removed_count;
+        }
+    }
+    return removed_count;
+}
+
+// Removes the assignments to variables that are not read before they are assigned
+// again or the program ends. Input is read even into a dead variable, so that the
+// following reads get the right numbers. Counts the statements removed.
+inline size_t RemoveDeadStores(ControlFlowGraph* graph, const ProgramVariables& variables) {
+    Liveness liveness;
+    liveness.Compute(*graph, *variables.var_index_in_memory, *variables.cur_memory_index);
+
+    size_t removed_count = 0;
+    auto& blocks = graph->Blocks();
+    for (size_t index = 0; index < blocks.size(); ++index) {
+        auto& statements = blocks[index].statements;
+        if (!blocks[index].is_reachable || statements.empty()) {
+            continue;
+        }
+        std::vector<bool> live = liveness.LiveOut(index);
+        liveness.LiveBeforeExit(blocks[index], *variables.var_index_in_memory, &live);
+
+        std::vector<bool> is_dead(statements.size(), false);
+        for (size_t i = statements.size(); i-- > 0;) {
+            if (statements[i].kind == StatementKind::ASSIGN && !live[statements[i].slot]) {
+                is_dead[i] = true;
+                ++removed_count;
+                continue;
+            }
+            liveness.LiveBefore(statements[i], *variables.var_index_in_memory, &live);
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < statements.size(); ++i) {
+            if (!is_dead[i]) {
+                statements[kept++] = std::move(statements[i]);
+            }
+        }
+        statements.resize(kept);
+    }
+    return removed_count;
+}
+
+// Frees the memory slots of the variables the program no longer reads or writes and
+// numbers the others again without gaps. Counts the variables removed.
+inline size_t RemoveUnusedVariables(ControlFlowGraph* graph, const ProgramVariables& variables) {
+    auto& var_index_in_memory = *variables.var_index_in_memory;
+    size_t variables_count = *variables.cur_memory_index;
+    std::vector<bool> is_used(variables_count, false);
+    ExpressionVariables expression_variables;
+    auto mark_reads = [&](const std::shared_ptr<Expression>& expr) {
+        for (size_t slot : expression_variables.Find(expr.get(), var_index_in_memory)) {
+            is_used[slot] = true;
+        }
+    };
+
+    auto& blocks = graph->Blocks();
+    for (const auto& block : blocks) {
+        if (!block.is_reachable) {
+            continue;
+        }
+        for (const auto& statement : block.statements) {
+            if (statement.kind != StatementKind::PRINT) {
+                is_used[statement.slot] = true;
+            }
+            if (statement.expression != nullptr) {
+                mark_reads(statement.expression);
+            }
+        }
+        if (block.exit == BlockExit::BRANCH) {
+            mark_reads(block.condition.lhs);
+            mark_reads(block.condition.rhs);
+        }
+    }
+
+    std::vector<size_t> new_slots(variables_count);
+    size_t used_count = 0;
+    for (size_t slot = 0; slot < variables_count; ++slot) {
+        new_slots[slot] = used_count;
+        used_count += is_used[slot] ? 1 : 0;
+    }
+    if (used_count == variables_count) {
+        return 0;
+    }
+
+    for (auto variable = var_index_in_memory.begin(); variable != var_index_in_memory.end();) {
+        if (is_used[variable->second]) {
+            variable->second = new_slots[variable->second];
+            ++variable;
+        } else {
+            variable = var_index_in_memory.erase(variable);
+        }
+    }
+    for (auto& block : blocks) {
+        for (auto& statement : block.statements) {
+            if (statement.kind != StatementKind::PRINT) {
+                statement.slot = new_slots[statement.slot];
+            }
+        }
+    }
+    *variables.cur_memory_index = used_count;
+    return variables_count - used_count;
+}
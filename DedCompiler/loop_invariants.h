@@ -0,0 +1,222 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "expression_evaluation.h"
+#include "statements.h"
+
+// Loop-invariant code motion. A subexpression of a while loop that reads no variable
+// the loop writes has the same value in every iteration, so it is computed once before
+// the loop, in a preheader that assigns it to a temporary variable, and the loop reads
+// the temporary instead. Outer loops are done first, so a value invariant in a whole
+// loop nest leaves all of it. The machine has no faults, evaluating a value the loop
+// might not need is harmless.
+class LoopInvariants {
+public:
+    struct Report {
+        size_t line;
+        // Instructions of one iteration before and after the hoisting: the condition,
+        // its jumps and the body without nested loops, before any other optimization.
+        uint64_t instructions_before;
+        uint64_t instructions_after;
+    };
+
+    // The temporaries are new variables in var_index_in_memory, the loops that are not
+    // nested in each other share them.
+    void Hoist(std::vector<Statement>* program, std::unordered_map<std::string, size_t>* var_index_in_memory,
+               size_t* cur_memory_index) {
+        var_index_in_memory_ = var_index_in_memory;
+        cur_memory_index_ = cur_memory_index;
+        HoistAll(program);
+    }
+
+    size_t HoistedCount() const {
+        return hoisted_count_;
+    }
+
+    // The loops something was hoisted out of, in the order of the source.
+    const std::vector<Report>& Reports() const {
+        return reports_;
+    }
+
+private:
+    void HoistAll(std::vector<Statement>* statements) {
+        std::vector<Statement> result;
+        result.reserve(statements->size());
+        for (auto& statement : *statements) {
+            if (statement.kind == StatementKind::IF) {
+                HoistAll(&statement.body);
+            } else if (statement.kind == StatementKind::WHILE) {
+                size_t temporaries_count = temporaries_count_;
+                uint64_t instructions_before = IterationSize(statement);
+                size_t report = reports_.size();
+                auto preheader = HoistLoop(&statement);
+                if (!preheader.empty()) {
+                    reports_.push_back({statement.line, instructions_before, 0});
+                }
+                HoistAll(&statement.body);
+                if (!preheader.empty()) {
+                    reports_[report].instructions_after = IterationSize(statement);
+                }
+                temporaries_count_ = temporaries_count;
+
+                for (auto& assign : preheader) {
+                    result.push_back(std::move(assign));
+                }
+            }
+            result.push_back(std::move(statement));
+        }
+        *statements = std::move(result);
+    }
+
+    // Replaces the invariants in the loop and returns the statements that compute them.
+    std::vector<Statement> HoistLoop(Statement* loop) {
+        written_.assign(*cur_memory_index_, false);
+        MarkWritten(loop->body);
+        rewritten_.clear();
+        preheader_.clear();
+        line_ = loop->line;
+
+        Rewrite(&loop->condition.lhs);
+        Rewrite(&loop->condition.rhs);
+        RewriteAll(&loop->body);
+        return std::move(preheader_);
+    }
+
+    void MarkWritten(const std::vector<Statement>& statements) {
+        for (const auto& statement : statements) {
+            if (statement.kind == StatementKind::ASSIGN || statement.kind == StatementKind::SCAN) {
+                written_[statement.slot] = true;
+            }
+            MarkWritten(statement.body);
+        }
+    }
+
+    void RewriteAll(std::vector<Statement>* statements) {
+        for (auto& statement : *statements) {
+            if (statement.expression != nullptr) {
+                Rewrite(&statement.expression);
+            }
+            if (statement.kind == StatementKind::IF || statement.kind == StatementKind::WHILE) {
+                Rewrite(&statement.condition.lhs);
+                Rewrite(&statement.condition.rhs);
+                RewriteAll(&statement.body);
+            }
+        }
+    }
+
+    void Rewrite(std::shared_ptr<Expression>* expr) {
+        *expr = Rewritten(*expr);
+    }
+
+    // expr with its largest invariant subexpressions read from temporaries.
+    std::shared_ptr<Expression> Rewritten(const std::shared_ptr<Expression>& expr) {
+        if (expr->left_ == nullptr) {
+            return expr;
+        }
+        auto found = rewritten_.find(expr.get());
+        if (found != rewritten_.end()) {
+            return found->second;
+        }
+
+        std::shared_ptr<Expression> result;
+        if (IsInvariant(expr.get())) {
+            result = MakeTemporary(expr);
+        } else {
+            auto left = Rewritten(expr->left_);
+            auto right = expr->right_ != nullptr ? Rewritten(expr->right_) : nullptr;
+            result = left == expr->left_ && right == expr->right_
+                         ? expr
+                         : expression_pool.MakeOperation(std::get<Operation>(expr->expression_), left, right);
+        }
+        rewritten_[expr.get()] = result;
+        return result;
+    }
+
+    bool IsInvariant(const Expression* expr) {
+        for (size_t slot : variables_.Find(expr, *var_index_in_memory_)) {
+            if (slot < written_.size() && written_[slot]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::shared_ptr<Expression> MakeTemporary(const std::shared_ptr<Expression>& expr) {
+        // No variable of the source can have this name.
+        std::string name = "$" + std::to_string(temporaries_count_++);
+        auto slot = var_index_in_memory_->find(name);
+        if (slot == var_index_in_memory_->end()) {
+            slot = var_index_in_memory_->emplace(name, (*cur_memory_index_)++).first;
+        }
+        preheader_.push_back({StatementKind::ASSIGN, line_, slot->second, expr});
+        ++hoisted_count_;
+        return expression_pool.MakeVariable(name);
+    }
+
+    uint64_t IterationSize(const Statement& loop) {
+        // The condition is at the bottom and jumps back to the body.
+        return ConditionSize(loop.condition) + 1 + BodySize(loop.body);
+    }
+
+    uint64_t ConditionSize(const Condition& condition) {
+        return ExpandedSize(condition.lhs.get()) + ExpandedSize(condition.rhs.get());
+    }
+
+    uint64_t BodySize(const std::vector<Statement>& statements) {
+        uint64_t size = 0;
+        for (const auto& statement : statements) {
+            switch (statement.kind) {
+                case StatementKind::ASSIGN:
+                case StatementKind::PRINT:
+                    size += ExpandedSize(statement.expression.get()) + 1;
+                    break;
+                case StatementKind::SCAN:
+                    size += 2;
+                    break;
+                case StatementKind::IF:
+                    size += ConditionSize(statement.condition) + 1 + BodySize(statement.body);
+                    break;
+                case StatementKind::WHILE:
+                    break;
+            }
+        }
+        return size;
+    }
+
+    // Instructions that compute expr without reusing anything.
+    uint64_t ExpandedSize(const Expression* expr) {
+        if (expr->left_ == nullptr) {
+            return 1;
+        }
+        auto found = expanded_sizes_.find(expr);
+        if (found != expanded_sizes_.end()) {
+            return found->second;
+        }
+        uint64_t size = 1 + ExpandedSize(expr->left_.get());
+        if (expr->right_ != nullptr) {
+            size += ExpandedSize(expr->right_.get());
+        }
+        expanded_sizes_[expr] = size;
+        return size;
+    }
+
+    std::unordered_map<std::string, size_t>* var_index_in_memory_ = nullptr;
+    size_t* cur_memory_index_ = nullptr;
+    ExpressionVariables variables_;
+    std::unordered_map<const Expression*, uint64_t> expanded_sizes_;
+
+    // The loop being hoisted from.
+    std::vector<bool> written_;
+    std::unordered_map<const Expression*, std::shared_ptr<Expression>> rewritten_;
+    std::vector<Statement> preheader_;
+    size_t line_ = 0;
+
+    size_t temporaries_count_ = 0;
+    size_t hoisted_count_ = 0;
+    std::vector<Report> reports_;
+};
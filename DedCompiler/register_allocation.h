@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ir.h"
+
+// Chooses the variables that every outermost while loop keeps in the registers ra..rd
+// while it runs. A variable is as hot as often the loop nest reads and writes it, the
+// statements of a loop inside count eight times as much as the ones around it. The
+// variables live when the loop starts are loaded into their registers before it, the
+// ones it writes and still live after it are stored back at its end, so nothing inside
+// the loop touches their memory.
+class RegisterAllocation {
+public:
+    static constexpr size_t REGISTERS_COUNT = 4;
+
+    struct LoopNest {
+        // Slots of the variables in ra, rb and so on.
+        std::vector<size_t> registers;
+        // The ones loaded from memory at the end of the preheader.
+        std::vector<size_t> loads;
+        // The ones written back to memory at the start of the exit.
+        std::vector<size_t> stores;
+        // The first block after the loop.
+        size_t exit;
+    };
+
+    // variables_count is the number of memory slots of the variables, the temporaries
+    // of the code come after them.
+    void Analyze(const ControlFlowGraph& graph, const std::unordered_map<std::string, size_t>& var_index_in_memory,
+                 size_t variables_count) {
+        var_index_in_memory_ = &var_index_in_memory;
+        variables_count_ = variables_count;
+        Liveness liveness;
+        liveness.Compute(graph, var_index_in_memory, variables_count);
+        for (const auto& loop : graph.Loops()) {
+            if (loop.depth == 0 && graph.Blocks()[loop.header].is_reachable) {
+                Allocate(graph, loop, liveness);
+            }
+        }
+    }
+
+    // The registers of the outermost loop the block is the preheader of, nullptr if
+    // there is none.
+    const LoopNest* FindByPreheader(size_t block) const {
+        auto found = loop_nests_.find(block);
+        return found != loop_nests_.end() ? &found->second : nullptr;
+    }
+
+    // Variables kept in registers, counted once for every loop nest.
+    size_t AllocatedCount() const {
+        return allocated_count_;
+    }
+
+    size_t LoopNestsCount() const {
+        return loop_nests_.size();
+    }
+
+private:
+    static constexpr double NESTED_LOOP_WEIGHT = 8;
+
+    void Allocate(const ControlFlowGraph& graph, const Loop& loop, const Liveness& liveness) {
+        std::vector<double> weights(variables_count_, 0);
+        std::vector<bool> written(variables_count_, false);
+        const auto& blocks = graph.Blocks();
+        for (size_t index = loop.body; index < loop.exit; ++index) {
+            if (blocks[index].is_reachable) {
+                Count(blocks[index], std::pow(NESTED_LOOP_WEIGHT, blocks[index].loop_depth - 1), &weights,
+                      &written);
+            }
+        }
+
+        std::vector<size_t> candidates;
+        for (size_t slot = 0; slot < variables_count_; ++slot) {
+            if (weights[slot] > 0) {
+                candidates.push_back(slot);
+            }
+        }
+        size_t count = std::min(candidates.size(), REGISTERS_COUNT);
+        std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+                          [&weights](size_t lhs, size_t rhs) {
+                              return weights[lhs] != weights[rhs] ? weights[lhs] > weights[rhs] : lhs < rhs;
+                          });
+        candidates.resize(count);
+
+        LoopNest& nest = loop_nests_[loop.preheader];
+        nest.registers = candidates;
+        nest.exit = loop.exit;
+        bool has_exit = blocks[loop.exit].is_reachable;
+        for (size_t slot : candidates) {
+            if (liveness.LiveIn(loop.header)[slot]) {
+                nest.loads.push_back(slot);
+            }
+            if (has_exit && written[slot] && liveness.LiveIn(loop.exit)[slot]) {
+                nest.stores.push_back(slot);
+            }
+        }
+        allocated_count_ += count;
+    }
+
+    // Adds weight to the variables the block reads and writes, and marks the ones it
+    // writes.
+    void Count(const BasicBlock& block, double weight, std::vector<double>* weights, std::vector<bool>* written) {
+        for (const auto& statement : block.statements) {
+            if (statement.kind != StatementKind::PRINT) {
+                (*weights)[statement.slot] += weight;
+                (*written)[statement.slot] = true;
+            }
+            if (statement.expression != nullptr) {
+                AddWeight(statement.expression.get(), weight, weights);
+            }
+        }
+        if (block.exit == BlockExit::BRANCH) {
+            AddWeight(block.condition.lhs.get(), weight, weights);
+            AddWeight(block.condition.rhs.get(), weight, weights);
+        }
+    }
+
+    void AddWeight(const Expression* expr, double weight, std::vector<double>* weights) {
+        for (size_t slot : variables_.Find(expr, *var_index_in_memory_)) {
+            (*weights)[slot] += weight;
+        }
+    }
+
+    const std::unordered_map<std::string, size_t>* var_index_in_memory_ = nullptr;
+    size_t variables_count_ = 0;
+    ExpressionVariables variables_;
+    std::unordered_map<size_t, LoopNest> loop_nests_;
+    size_t allocated_count_ = 0;
+};
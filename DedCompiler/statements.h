@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "commands.h"
+#include "expression_evaluation.h"
+
+enum class StatementKind {
+    ASSIGN,
+    SCAN,
+    PRINT,
+    IF,
+    WHILE
+};
+
+// Condition of if and while: the body runs when jump would jump on lhs and rhs.
+struct Condition {
+    std::shared_ptr<Expression> lhs;
+    std::shared_ptr<Expression> rhs;
+    Command jump = JE;
+};
+
+// The program is parsed into a tree of statements before any code is emitted, so the
+// optimizations can look at a whole loop.
+struct Statement {
+    StatementKind kind;
+    size_t line;
+    // Memory slot of the variable that ASSIGN and SCAN store to.
+    size_t slot = 0;
+    // Value of ASSIGN and PRINT.
+    std::shared_ptr<Expression> expression = nullptr;
+    // IF and WHILE.
+    Condition condition{};
+    std::vector<Statement> body{};
+};
+
+// Sorted memory slots of the variables an expression reads, remembered per node.
+class ExpressionVariables {
+public:
+    const std::vector<size_t>& Find(const Expression* expr,
+                                    const std::unordered_map<std::string, size_t>& var_index_in_memory) {
+        auto found = variables_.find(expr);
+        if (found != variables_.end()) {
+            return found->second;
+        }
+
+        std::vector<size_t> slots;
+        if (auto variable = std::get_if<Variable>(&expr->expression_)) {
+            auto slot = var_index_in_memory.find(variable->name);
+            if (slot != var_index_in_memory.end()) {
+                slots.push_back(slot->second);
+            }
+        } else if (expr->left_ != nullptr) {
+            const auto& left = Find(expr->left_.get(), var_index_in_memory);
+            const auto& right = expr->right_ != nullptr ? Find(expr->right_.get(), var_index_in_memory)
+                                                        : no_variables_;
+            std::set_union(left.begin(), left.end(), right.begin(), right.end(), std::back_inserter(slots));
+        }
+        return variables_[expr] = std::move(slots);
+    }
+
+    // Forgets the slots, which changed.
+    void Clear() {
+        variables_.clear();
+    }
+
+private:
+    std::unordered_map<const Expression*, std::vector<size_t>> variables_;
+    const std::vector<size_t> no_variables_;
+};
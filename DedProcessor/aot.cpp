@@ -0,0 +1,537 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bytecode.h"
+#include "commands.h"
+#include "heap.h"
+#include "object.h"
+
+// Values of the VM stack that are produced inside the current basic block live in
+// C++ locals; only what is left at the end of the block goes to the runtime stack.
+class VirtualStack {
+public:
+    explicit VirtualStack(std::ostream* out) : out_(out) {
+    }
+
+    std::string NewValue(const std::string& expression) {
+        std::string name = "t" + std::to_string(next_temp_++);
+        *out_ << "        Value " << name << " = " << expression << ";\n";
+        return name;
+    }
+
+    void Push(const std::string& expression) {
+        values_.emplace_back(NewValue(expression));
+    }
+
+    std::string Pop() {
+        if (values_.empty()) {
+            return NewValue("Pop()");
+        }
+        std::string value = values_.back();
+        values_.pop_back();
+        return value;
+    }
+
+    std::string Top() {
+        if (values_.empty()) {
+            return "Top()";
+        }
+        return values_.back();
+    }
+
+    void Drop() {
+        if (values_.empty()) {
+            *out_ << "        Pop();\n";
+            return;
+        }
+        values_.pop_back();
+    }
+
+    void Flush() {
+        for (const auto& value : values_) {
+            *out_ << "        stack.push_back(" << value << ");\n";
+        }
+        values_.clear();
+    }
+
+private:
+    std::ostream* out_;
+    std::vector<std::string> values_;
+    size_t next_temp_ = 0;
+};
+
+std::string BlockLabel(long long index) {
+    return "L" + std::to_string(index);
+}
+
+// A constant of the program as C++ source. NaN and infinities have no literal, and
+// constant folding in DedCompiler produces them, so they are spelled with
+// numeric_limits; the sign of a NaN is kept, it shows when the NaN is printed.
+std::string Constant(double value) {
+    if (std::isnan(value)) {
+        return std::signbit(value) ? "-std::numeric_limits<Value>::quiet_NaN()"
+                                   : "std::numeric_limits<Value>::quiet_NaN()";
+    }
+    if (std::isinf(value)) {
+        return value < 0 ? "-std::numeric_limits<Value>::infinity()" : "std::numeric_limits<Value>::infinity()";
+    }
+    char number[64];
+    std::snprintf(number, sizeof(number), "%.17g", value);
+    return number;
+}
+
+std::string Register(size_t number) {
+    return "r" + std::to_string(number);
+}
+
+std::string Register(double number) {
+    return Register(static_cast<size_t>(number));
+}
+
+bool ResolveTarget(const std::vector<Instruction>& program, const Instruction& instruction,
+                   std::string& label) {
+    long long target = FindInstructionByOffset(program, JumpTarget(instruction));
+    if (target == -1) {
+        std::cout << "Invalid jump target at offset " << instruction.offset << "\n";
+        return false;
+    }
+    label = BlockLabel(target);
+    return true;
+}
+
+bool UsesHeap(const std::vector<Instruction>& program) {
+    for (const auto& instruction : program) {
+        Command command = instruction.command;
+        if (command == ALLOC || command == FREE || command == ARENA_ALLOC || command == ARENA_RESET) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// C++ spelling of every ValueType, the generated program computes with it.
+const char* value_type_declarations[static_cast<size_t>(ValueType::COUNT)] = {
+        "double",
+        "float",
+        "int64_t",
+        "long double"
+};
+
+bool UsesFrames(const std::vector<Instruction>& program) {
+    for (const auto& instruction : program) {
+        Command command = instruction.command;
+        if (command == ENTER || command == LEAVE || command == LOAD_LOCAL || command == STORE_LOCAL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void EmitPrologue(std::ostream* out, bool uses_heap, bool uses_frames, ValueType type) {
+    *out << "#include <algorithm>\n"
+            "#include <cmath>\n"
+            "#include <cstdint>\n"
+            "#include <iostream>\n"
+            "#include <limits>\n"
+            "#include <vector>\n";
+    if (uses_heap) {
+        *out << "\n#include \"heap.h\"\n"
+                "\n"
+                "static Heap heap{" << STATIC_MEMORY_SIZE << ", " << MEMORY_SIZE << "};\n";
+    }
+    *out << "\n"
+            "using Value = " << value_type_declarations[static_cast<size_t>(type)] << ";\n"
+            "\n"
+            "static Value memory[" << MEMORY_SIZE << "];\n"
+            "static std::vector<Value> stack;\n"
+            "static std::vector<size_t> instruction_stack;\n"
+            "\n";
+    if (uses_frames) {
+        *out << "struct Frame {\n"
+                "    size_t base;\n"
+                "    size_t size;\n"
+                "};\n"
+                "\n"
+                "static Value locals[" << FRAME_STACK_SIZE << "];\n"
+                "static Frame frames[" << FRAMES_DEPTH << "];\n"
+                "static size_t frames_count = 0;\n"
+                "static Frame frame{0, 0};\n"
+                "\n";
+    }
+    *out << 
+            "static inline Value Top() {\n"
+            "    return stack.empty() ? Value() : stack.back();\n"
+            "}\n"
+            "\n"
+            "static inline Value Pop() {\n"
+            "    Value value = Top();\n"
+            "    if (!stack.empty()) {\n"
+            "        stack.pop_back();\n"
+            "    }\n"
+            "    return value;\n"
+            "}\n"
+            "\n"
+            "int main() {\n"
+            "    std::ios::sync_with_stdio(false);\n";
+    for (size_t i = 0; i < REGISTERS_COUNT; ++i) {
+        *out << "    Value " << Register(i) << " = 0;\n";
+    }
+    *out << "    stack.reserve(1024);\n"
+            "    instruction_stack.reserve(1024);\n"
+            "\n";
+}
+
+void EmitReturnDispatch(const std::vector<Instruction>& program, std::ostream* out) {
+    *out << "        size_t return_address = 0;\n"
+            "        if (!instruction_stack.empty()) {\n"
+            "            return_address = instruction_stack.back();\n"
+            "            instruction_stack.pop_back();\n"
+            "        }\n"
+            "        switch (return_address) {\n"
+            "            case 0:\n"
+            "                goto L0;\n";
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (program[i].command == CALL) {
+            size_t return_address = program[i].offset + 1 + program[i].args.size();
+            *out << "            case " << return_address << ":\n"
+                 << "                goto " << BlockLabel(i + 1) << ";\n";
+        }
+    }
+    *out << "            default:\n"
+            "                return 0;\n"
+            "        }\n";
+}
+
+// Stops the program like the processor does when address, a C++ local, is outside the
+// memory. Static addresses are checked by DecodeProgram.
+void EmitAddressCheck(const std::string& address, size_t offset, std::ostream* out) {
+    *out << "        if (!(" << address << " >= 0 && " << address << " < " << MEMORY_SIZE << ")) {\n"
+         << "            std::cerr << \"Runtime error: memory access out of bounds at offset " << offset
+         << "\\n\";\n"
+         << "            return 1;\n"
+         << "        }\n";
+}
+
+bool TranslateInstruction(const std::vector<Instruction>& program, size_t index,
+                          VirtualStack* stack, std::ostream* out) {
+    const Instruction& instruction = program[index];
+    std::string label;
+    switch (instruction.command) {
+        case ADD: {
+            auto rhs = stack->Pop();
+            auto lhs = stack->Pop();
+            stack->Push(lhs + " + " + rhs);
+            break;
+        }
+        case SUB: {
+            auto rhs = stack->Pop();
+            auto lhs = stack->Pop();
+            stack->Push(lhs + " - " + rhs);
+            break;
+        }
+        case MUL: {
+            auto rhs = stack->Pop();
+            auto lhs = stack->Pop();
+            stack->Push(lhs + " * " + rhs);
+            break;
+        }
+        case DIV: {
+            auto rhs = stack->Pop();
+            auto lhs = stack->Pop();
+            stack->Push(lhs + " / " + rhs);
+            break;
+        }
+        case SQRT:
+            stack->Push("std::sqrt(" + stack->Pop() + ")");
+            break;
+        case JUMP:
+            if (!ResolveTarget(program, instruction, label)) {
+                return false;
+            }
+            stack->Flush();
+            *out << "        goto " << label << ";\n";
+            break;
+        case JE:
+        case JN:
+        case JL:
+        case JG:
+        case JGE:
+        case JLE: {
+            if (!ResolveTarget(program, instruction, label)) {
+                return false;
+            }
+            auto rhs = stack->Pop();
+            auto lhs = stack->Pop();
+            stack->Flush();
+            // JGE and JLE are the negations of JL and JG, which differ from >= and <= for NaN.
+            bool is_negated = instruction.command == JGE || instruction.command == JLE;
+            std::string sign = instruction.command == JE ? " == " :
+                               instruction.command == JN ? " != " :
+                               instruction.command == JL || instruction.command == JGE ? " < " : " > ";
+            std::string condition = lhs + sign + rhs;
+            if (is_negated) {
+                condition = "!(" + condition + ")";
+            }
+            *out << "        if (" << condition << ") {\n"
+                 << "            goto " << label << ";\n"
+                 << "        }\n";
+            break;
+        }
+        case PUSH:
+            stack->Push(Constant(instruction.args[0]));
+            break;
+        case POP:
+            stack->Drop();
+            break;
+        case MOV_STOA:
+            *out << "        r0 = " << stack->Pop() << ";\n";
+            break;
+        case MOV_STOB:
+            *out << "        r1 = " << stack->Pop() << ";\n";
+            break;
+        case MOV_STOC:
+            *out << "        r2 = " << stack->Pop() << ";\n";
+            break;
+        case MOV_STOD:
+            *out << "        r3 = " << stack->Pop() << ";\n";
+            break;
+        case MOV_STOMEM:
+            *out << "        memory[" << static_cast<size_t>(instruction.args[0]) << "] = "
+                 << stack->Pop() << ";\n";
+            break;
+        case MOV_ATOS:
+            stack->Push("r0");
+            break;
+        case MOV_BTOS:
+            stack->Push("r1");
+            break;
+        case MOV_CTOS:
+            stack->Push("r2");
+            break;
+        case MOV_DTOS:
+            stack->Push("r3");
+            break;
+        case MOV_MEMTOS:
+            stack->Push("memory[" + std::to_string(static_cast<size_t>(instruction.args[0])) + "]");
+            break;
+        case IN: {
+            auto value = stack->NewValue("0");
+            *out << "        std::cin >> " << value << ";\n";
+            stack->Push(value);
+            break;
+        }
+        case OUT:
+            *out << "        std::cout << " << stack->Top() << " << \"\\n\";\n";
+            break;
+        case CALL: {
+            if (!ResolveTarget(program, instruction, label)) {
+                return false;
+            }
+            stack->Flush();
+            size_t return_address = instruction.offset + 1 + instruction.args.size();
+            *out << "        instruction_stack.push_back(" << return_address << ");\n"
+                 << "        goto " << label << ";\n";
+            break;
+        }
+        case RET:
+            stack->Flush();
+            EmitReturnDispatch(program, out);
+            break;
+        case END:
+            *out << "        return 0;\n";
+            break;
+        case DUP:
+            stack->Push(stack->Top());
+            break;
+        case ALLOC:
+            stack->Push("static_cast<Value>(heap.Allocate(" +
+                        std::to_string(static_cast<size_t>(instruction.args[0])) + "))");
+            break;
+        case FREE: {
+            // An address the memory does not cover is an invalid free, as in the processor.
+            auto address = stack->Pop();
+            *out << "        heap.Free(" << address << " >= 0 && " << address << " < " << MEMORY_SIZE
+                 << " ? static_cast<size_t>(" << address << ") : " << MEMORY_SIZE << ");\n";
+            break;
+        }
+        case ARENA_ALLOC:
+            stack->Push("static_cast<Value>(heap.ArenaAllocate(" +
+                        std::to_string(static_cast<size_t>(instruction.args[0])) + "))");
+            break;
+        case ARENA_RESET:
+            *out << "        heap.ArenaReset();\n";
+            break;
+        case LOAD: {
+            auto address = stack->Pop();
+            EmitAddressCheck(address, instruction.offset, out);
+            stack->Push("memory[static_cast<size_t>(" + address + ")]");
+            break;
+        }
+        case STORE: {
+            auto address = stack->Pop();
+            auto value = stack->Pop();
+            EmitAddressCheck(address, instruction.offset, out);
+            *out << "        memory[static_cast<size_t>(" << address << ")] = " << value << ";\n";
+            break;
+        }
+        case RADD:
+        case RSUB:
+        case RMUL:
+        case RDIV: {
+            std::string sign = instruction.command == RADD ? " + " :
+                               instruction.command == RSUB ? " - " :
+                               instruction.command == RMUL ? " * " : " / ";
+            *out << "        " << Register(instruction.args[0]) << " = " << Register(instruction.args[1])
+                 << sign << Register(instruction.args[2]) << ";\n";
+            break;
+        }
+        case RSET:
+            *out << "        " << Register(instruction.args[0]) << " = " << Constant(instruction.args[1]) << ";\n";
+            break;
+        case RMOV:
+            *out << "        " << Register(instruction.args[0]) << " = "
+                 << Register(instruction.args[1]) << ";\n";
+            break;
+        case RLOAD:
+            *out << "        " << Register(instruction.args[0]) << " = memory["
+                 << static_cast<size_t>(instruction.args[1]) << "];\n";
+            break;
+        case RSTORE:
+            *out << "        memory[" << static_cast<size_t>(instruction.args[1]) << "] = "
+                 << Register(instruction.args[0]) << ";\n";
+            break;
+        case RPUSH:
+            stack->Push(Register(instruction.args[0]));
+            break;
+        case RPOP:
+            *out << "        " << Register(instruction.args[0]) << " = " << stack->Pop() << ";\n";
+            break;
+        case RJE:
+        case RJN:
+        case RJL:
+        case RJG: {
+            if (!ResolveTarget(program, instruction, label)) {
+                return false;
+            }
+            stack->Flush();
+            std::string sign = instruction.command == RJE ? " == " :
+                               instruction.command == RJN ? " != " :
+                               instruction.command == RJL ? " < " : " > ";
+            *out << "        if (" << Register(instruction.args[0]) << sign
+                 << Register(instruction.args[1]) << ") {\n"
+                 << "            goto " << label << ";\n"
+                 << "        }\n";
+            break;
+        }
+        case ENTER: {
+            size_t size = static_cast<size_t>(instruction.args[0]);
+            *out << "        if (frames_count == " << FRAMES_DEPTH << " || " << size << " > "
+                 << FRAME_STACK_SIZE << " - frame.base - frame.size) {\n"
+                 << "            std::cerr << \"Runtime error: frame stack overflow\\n\";\n"
+                 << "            return 1;\n"
+                 << "        }\n"
+                 << "        frames[frames_count++] = frame;\n"
+                 << "        frame = {frame.base + frame.size, " << size << "};\n"
+                 << "        std::fill(locals + frame.base, locals + frame.base + frame.size, Value());\n";
+            break;
+        }
+        case LEAVE:
+            *out << "        if (frames_count == 0) {\n"
+                 << "            std::cerr << \"Runtime error: LEAVE without ENTER\\n\";\n"
+                 << "            return 1;\n"
+                 << "        }\n"
+                 << "        frame = frames[--frames_count];\n";
+            break;
+        case LOAD_LOCAL:
+        case STORE_LOCAL: {
+            size_t index = static_cast<size_t>(instruction.args[0]);
+            *out << "        if (" << index << " >= frame.size) {\n"
+                 << "            std::cerr << \"Runtime error: local outside of the frame\\n\";\n"
+                 << "            return 1;\n"
+                 << "        }\n";
+            std::string local = "locals[frame.base + " + std::to_string(index) + "]";
+            if (instruction.command == LOAD_LOCAL) {
+                stack->Push(local);
+            } else {
+                *out << "        " << local << " = " << stack->Pop() << ";\n";
+            }
+            break;
+        }
+        default:
+            std::cout << "Unknown command at offset " << instruction.offset << "\n";
+            return false;
+    }
+    return true;
+}
+
+bool Translate(const std::vector<Instruction>& program, ValueType type, std::ostream* out) {
+    auto is_leader = FindLeaders(program);
+
+    EmitPrologue(out, UsesHeap(program), UsesFrames(program), type);
+    for (size_t begin = 0; begin < program.size();) {
+        size_t end = begin + 1;
+        while (end < program.size() && !is_leader[end]) {
+            ++end;
+        }
+
+        *out << BlockLabel(begin) << ": {\n";
+        VirtualStack stack(out);
+        for (size_t i = begin; i < end; ++i) {
+            if (!TranslateInstruction(program, i, &stack, out)) {
+                return false;
+            }
+        }
+        stack.Flush();
+        *out << "    }\n";
+        begin = end;
+    }
+    *out << BlockLabel(program.size()) << ":\n"
+         << "    return 0;\n"
+         << "}\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2 && !(argc == 3 && std::string(argv[2]) == "--build")) {
+        std::cout << "Invalid count of arguments.\n Enter name of input file [--build]\n";
+        return 0;
+    }
+
+    std::string input_name(argv[1]);
+    std::string output_name("a.cpp");
+
+    ObjectFile object;
+    if (ReadObject(input_name, &object) == -1) {
+        std::cout << "Invalid object file\n";
+        return 0;
+    }
+    if (const Symbol* import = FindImport(object)) {
+        std::cout << "Unresolved symbol " << import->name << ", link the program with dedld\n";
+        return 0;
+    }
+
+    std::vector<Instruction> program;
+    if (!DecodeProgram(object.code, &program)) {
+        std::cout << "Translation terminated\n";
+        return 0;
+    }
+    std::ofstream output(output_name);
+    if (!Translate(program, GetValueType(object), &output)) {
+        std::cout << "Translation terminated\n";
+        return 0;
+    }
+    output.close();
+
+    if (argc == 3) {
+        std::string command = "c++ -O2 -std=c++17 -I" DED_INCLUDE_DIR " -o a.out " + output_name;
+        if (std::system(command.data()) != 0) {
+            std::cout << "Native compilation failed\n";
+        }
+    }
+    return 0;
+}
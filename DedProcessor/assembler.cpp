@@ -1,156 +1,741 @@
-#include <iostream>
+#include <algorithm>
+#include <charconv>
 #include <cstdio>
+#include <iostream>
+#include <limits>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 
+#include "build_cache.h"
 #include "commands.h"
+#include "object.h"
 #include "utils.h"
 
 
-std::string ExtractLine(const std::string &buffer, size_t &begin) {
-    size_t end = begin;
-    while (end < buffer.size() && buffer[end] != '\n') {
-        ++end;
-    }
-
-    std::string line = buffer.substr(begin, end - begin);
-    begin = end + 1;
-    return line;
-}
+// Splits line into words separated by spaces, tabs or commas. Returns the number of
+// words; only the first max_words of them are stored.
+size_t SplitLine(std::string_view line, std::string_view* words, size_t max_words) {
+    auto is_separator = [](char symbol) {
+        return symbol == ' ' || symbol == '\t' || symbol == '\r' || symbol == ',';
+    };
 
-std::vector<std::string> ParseLine(const std::string &line) {
-    std::vector<std::string> parts;
+    size_t count = 0;
     for (size_t cur = 0; cur < line.size();) {
-        while (cur < line.size() && line[cur] == ' ') {
+        while (cur < line.size() && is_separator(line[cur])) {
             ++cur;
         }
 
         size_t begin = cur;
-        while (cur < line.size() && line[cur] != ' ') {
+        while (cur < line.size() && !is_separator(line[cur])) {
             ++cur;
         }
 
-        size_t length = cur - begin;
-        if (cur == ' ') {
-            --length;
+        if (cur > begin) {
+            if (count < max_words) {
+                words[count] = line.substr(begin, cur - begin);
+            }
+            ++count;
         }
-
-        parts.emplace_back(line.substr(begin, length));
     }
-    return parts;
+    return count;
 }
 
 enum class AssemblyStatus {
     OK,
     INVALID_NAME,
-    INVALID_ARGS_CNT
+    INVALID_ARGS_CNT,
+    INVALID_REGISTER,
+    INVALID_NUMBER,
+    INVALID_ADDRESS,
+    INVALID_SYMBOL,
+    DUPLICATE_LABEL
 };
 
-std::pair<AssemblyStatus, std::vector<double>>
-AssemblyCommand(const std::vector<std::string> &parts) {
-    for (const auto &part : parts) {
-        std::cout << part << " ";
+// ADD r1, r2, r3 and friends are the three-address forms of the stack arithmetic.
+Command RegisterForm(Command command) {
+    switch (command) {
+        case ADD:
+            return RADD;
+        case SUB:
+            return RSUB;
+        case MUL:
+            return RMUL;
+        case DIV:
+            return RDIV;
+        default:
+            return command;
     }
-    std::cout << "\n";
+}
 
-    auto found = command_by_name.find(parts[0]);
-    if (found == command_by_name.end()) {
-        return {AssemblyStatus::INVALID_NAME, std::vector<double>()};
+// Parses register operand r0..r15 into its number, returns -1 if it is not one.
+int ParseRegister(std::string_view operand) {
+    if (operand.size() < 2 || operand[0] != 'r') {
+        return -1;
+    }
+    int number = 0;
+    for (size_t i = 1; i < operand.size(); ++i) {
+        if (operand[i] < '0' || operand[i] > '9') {
+            return -1;
+        }
+        number = number * 10 + (operand[i] - '0');
+        if (number >= static_cast<int>(REGISTERS_COUNT)) {
+            return -1;
+        }
     }
+    return number;
+}
 
-    Command command = found->second;
-    if (HasNoArg(command) && parts.size() != 1) {
-        return {AssemblyStatus::INVALID_ARGS_CNT, std::vector<double>()};
+bool ParseNumber(std::string_view operand, double* number) {
+    if (!operand.empty() && operand[0] == '+') {
+        operand.remove_prefix(1);
     }
+    const char* end = operand.data() + operand.size();
+    auto result = std::from_chars(operand.data(), end, *number);
+    return result.ec == std::errc() && result.ptr == end;
+}
+
+// Code offsets of labels. Labels written by DedCompiler and the disassembler are small
+// and dense, so they are looked up in a vector; any others go to a hash map.
+class LabelTable {
+public:
+    static constexpr size_t UNDEFINED = std::numeric_limits<size_t>::max();
 
-    if (HasOneArg(command) && parts.size() != 2) {
-        return {AssemblyStatus::INVALID_ARGS_CNT, std::vector<double>()};
+    // Returns false if the label is already defined.
+    bool Define(long long label, size_t offset) {
+        size_t& slot = Slot(label);
+        if (slot != UNDEFINED) {
+            return false;
+        }
+        slot = offset;
+        return true;
     }
 
-    std::vector<double> instruction;
-    instruction.emplace_back(command);
-    for (size_t i = 1; i < parts.size(); ++i) {
-        instruction.emplace_back(std::stod(parts[i]));
+    size_t Find(long long label) const {
+        if (label < 0 || label >= DENSE_LABELS) {
+            auto found = sparse_.find(label);
+            return found == sparse_.end() ? UNDEFINED : found->second;
+        }
+        return static_cast<size_t>(label) < dense_.size() ? dense_[label] : UNDEFINED;
     }
-    return {AssemblyStatus::OK, instruction};
+
+private:
+    static constexpr long long DENSE_LABELS = 1 << 24;
+
+    size_t& Slot(long long label) {
+        if (label < 0 || label >= DENSE_LABELS) {
+            return sparse_.emplace(label, UNDEFINED).first->second;
+        }
+        if (static_cast<size_t>(label) >= dense_.size()) {
+            dense_.resize(static_cast<size_t>(label) + 1, UNDEFINED);
+        }
+        return dense_[label];
+    }
+
+    std::vector<size_t> dense_;
+    std::unordered_map<long long, size_t> sparse_;
+};
+
+// Named labels may start with a letter, '_' or '.', and continue with letters, digits,
+// '_' or '.'.
+bool IsSymbolName(std::string_view word) {
+    auto is_start = [](char symbol) {
+        return (symbol >= 'a' && symbol <= 'z') || (symbol >= 'A' && symbol <= 'Z') || symbol == '_' ||
+               symbol == '.';
+    };
+    if (word.empty() || !is_start(word[0])) {
+        return false;
+    }
+    for (char symbol : word) {
+        if (!is_start(symbol) && !(symbol >= '0' && symbol <= '9')) {
+            return false;
+        }
+    }
+    return true;
 }
 
-int ScanInstructions(const std::string &buffer, bool is_for_label, const std::string &output_name,
-                     std::unordered_map<int, size_t> &instruction_number_by_label) {
+const size_t NO_SYMBOL = std::numeric_limits<size_t>::max();
+
+struct NamedLabel {
+    std::string_view name;
+    size_t offset = LabelTable::UNDEFINED;
+    bool is_exported = false;
+    bool is_imported = false;
+    size_t symbol = NO_SYMBOL;
+    // Where the label is defined, for the error about a second definition.
+    uint32_t asm_line = 0;
+    std::string_view line{};
+};
+
+// Named labels in the order their names first appear.
+class NamedLabels {
+public:
+    size_t Find(std::string_view name) {
+        auto [found, is_new] = index_.emplace(name, labels_.size());
+        if (is_new) {
+            labels_.push_back({name});
+        }
+        return found->second;
+    }
+
+    NamedLabel& operator[](size_t index) {
+        return labels_[index];
+    }
+
+    const NamedLabel& operator[](size_t index) const {
+        return labels_[index];
+    }
+
+    std::vector<NamedLabel>& Labels() {
+        return labels_;
+    }
+
+private:
+    std::vector<NamedLabel> labels_;
+    std::unordered_map<std::string_view, size_t> index_;
+};
+
+struct AssemblyError {
+    AssemblyStatus status = AssemblyStatus::OK;
+    uint32_t asm_line = 0;
+    std::string_view name;
+    std::string_view line;
+};
+
+// A contiguous run of whole source lines encoded on its own. Offsets and line numbers
+// are relative to the chunk until the chunks are merged.
+struct Chunk {
+    struct NumberedLabel {
+        long long label;
+        size_t offset;
+        uint32_t asm_line;
+        std::string_view line;
+    };
+
+    // The target is the named label with index name_index if there is one, the
+    // numbered label otherwise.
+    struct Fixup {
+        size_t offset;
+        long long label;
+        size_t name_index;
+    };
+
+    std::string_view source;
+    uint32_t lines_count = 0;
+    std::vector<double> code;
+    std::vector<DebugEntry> debug;
+    // Debug entries before the first LINE of the chunk take the source line the
+    // previous chunks end with.
+    size_t inherited_lines_count = 0;
+    bool has_source_line = false;
+    uint32_t source_line = 0;
+    std::vector<NumberedLabel> numbered_labels;
+    NamedLabels named_labels;
+    std::vector<Fixup> fixups;
+    AssemblyError error;
+
+    // Set when the chunks are merged.
+    size_t base = 0;
+    size_t debug_base = 0;
+    uint32_t first_line = 0;
+    uint32_t inherited_source_line = 0;
+    std::vector<size_t> global_name_index;
+};
+
+// Encodes one chunk. LABEL and LINE produce no code: LINE n marks the following
+// instructions as compiled from line n of the source program.
+class ChunkAssembler {
+public:
+    ChunkAssembler(Chunk* chunk, bool echo) : chunk_(chunk), echo_(echo) {
+    }
+
+    void Assemble() {
+        std::string_view source = chunk_->source;
+        // Every code word takes a few bytes of source, so this rarely has to grow.
+        chunk_->code.reserve(source.size() / 4);
+        for (size_t begin = 0; begin < source.size();) {
+            size_t end = source.find('\n', begin);
+            if (end == std::string_view::npos) {
+                end = source.size();
+            }
+            std::string_view line = source.substr(begin, end - begin);
+            begin = end + 1;
+            ++chunk_->lines_count;
+
+            std::string_view words[MAX_WORDS];
+            size_t words_count = SplitLine(line, words, MAX_WORDS);
+            if (words_count == 0) {
+                continue;
+            }
+            if (echo_) {
+                std::cout << line << "\n";
+            }
 
-    FILE *output;
-    if (!is_for_label) {
-        output = fopen(output_name.data(), "w");
+            AssemblyStatus status = AssembleInstruction(words, words_count, chunk_->lines_count, line);
+            if (status != AssemblyStatus::OK) {
+                chunk_->error = {status, chunk_->lines_count, words[0], line};
+                chunk_->lines_count += std::count(source.begin() + std::min(begin, source.size()),
+                                                  source.end(), '\n');
+                return;
+            }
+        }
     }
 
-    for (size_t begin = 0, cur_program_size = 0; begin < buffer.size();) {
-        std::string line = ExtractLine(buffer, begin);
-        if (line.empty()) {
-            continue;
+private:
+    static constexpr size_t MAX_WORDS = 5;
+
+    AssemblyStatus AssembleInstruction(const std::string_view* words, size_t words_count,
+                                       uint32_t asm_line, std::string_view line) {
+        Command command;
+        if (!FindCommand(words[0], &command)) {
+            return AssemblyStatus::INVALID_NAME;
+        }
+        if (words_count == 4) {
+            command = RegisterForm(command);
         }
 
-        auto parts = ParseLine(line);
-        auto[status, instruction] = AssemblyCommand(parts);
-        if (status == AssemblyStatus::INVALID_NAME) {
-            std::cout << "Invalid command: " << parts[0] << "\n";
-            std::cout << "Assembling terminated\n";
-            if (!is_for_label) {
-                fclose(output);
+        const CommandInfo& info = GetCommandInfo(command);
+        if (words_count != info.args_count + 1) {
+            return AssemblyStatus::INVALID_ARGS_CNT;
+        }
+
+        double args[MAX_WORDS - 1];
+        size_t args_count = words_count - 1;
+        size_t name_index = NO_SYMBOL;
+        for (size_t i = 0; i < args_count; ++i) {
+            if (info.operands[i] == OperandKind::REGISTER) {
+                int number = ParseRegister(words[i + 1]);
+                if (number == -1) {
+                    return AssemblyStatus::INVALID_REGISTER;
+                }
+                args[i] = number;
+            } else if (info.operands[i] == OperandKind::LABEL && IsSymbolName(words[i + 1])) {
+                name_index = chunk_->named_labels.Find(words[i + 1]);
+                args[i] = 0;
+            } else if (!ParseNumber(words[i + 1], &args[i])) {
+                return AssemblyStatus::INVALID_NUMBER;
             }
-            return -1;
-        } else if (status == AssemblyStatus::INVALID_ARGS_CNT) {
-            std::cout << "Invalid number of arguments for command: " << parts[0] << "\n";
+            if (info.operands[i] == OperandKind::ADDRESS && !IsMemoryAddress(args[i])) {
+                return AssemblyStatus::INVALID_ADDRESS;
+            }
+        }
+
+        if (info.flags & DIRECTIVE) {
+            return AssembleDirective(command, args[0], name_index, asm_line, line);
+        }
+
+        if (!chunk_->has_source_line) {
+            ++chunk_->inherited_lines_count;
+        }
+        chunk_->debug.push_back({chunk_->code.size(), asm_line, chunk_->source_line});
+        chunk_->code.emplace_back(command);
+        chunk_->code.insert(chunk_->code.end(), args, args + args_count);
+        if (RequiresLabel(command)) {
+            chunk_->fixups.push_back({chunk_->code.size() - 1, static_cast<long long>(args[args_count - 1]),
+                                      name_index});
+        }
+        return AssemblyStatus::OK;
+    }
+
+    AssemblyStatus AssembleDirective(Command command, double arg, size_t name_index, uint32_t asm_line,
+                                     std::string_view line) {
+        if (command == LINE) {
+            chunk_->has_source_line = true;
+            chunk_->source_line = static_cast<uint32_t>(arg);
+            return AssemblyStatus::OK;
+        }
+        if (command == LABEL) {
+            if (name_index == NO_SYMBOL) {
+                chunk_->numbered_labels.push_back({static_cast<long long>(arg), chunk_->code.size(), asm_line,
+                                                   line});
+                return AssemblyStatus::OK;
+            }
+            NamedLabel& label = chunk_->named_labels[name_index];
+            if (label.offset != LabelTable::UNDEFINED) {
+                return AssemblyStatus::DUPLICATE_LABEL;
+            }
+            label.offset = chunk_->code.size();
+            label.asm_line = asm_line;
+            label.line = line;
+            return AssemblyStatus::OK;
+        }
+
+        if (name_index == NO_SYMBOL) {
+            return AssemblyStatus::INVALID_SYMBOL;
+        }
+        if (command == EXPORT) {
+            chunk_->named_labels[name_index].is_exported = true;
+        } else {
+            chunk_->named_labels[name_index].is_imported = true;
+        }
+        return AssemblyStatus::OK;
+    }
+
+    Chunk* chunk_;
+    bool echo_;
+};
+
+// Calls function(i) for i in [0, count), each on a thread of its own; the calling
+// thread takes i = 0.
+template <class Function>
+void ForEachInParallel(size_t count, Function function) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; ++i) {
+        threads.emplace_back(function, i);
+    }
+    function(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Encodes the source into object. The source is split at line boundaries into one
+// chunk per thread, and the chunks are encoded concurrently. Their labels are then
+// merged in source order, and every chunk is copied into place with its jump targets
+// patched, again concurrently. The result does not depend on the number of threads.
+//
+// Numbered labels are always local to the source. A named label is local too unless
+// it is exported with EXPORT name; IMPORT name lets the source jump to a label another
+// module exports. With is_module the object gets the link tables dedld needs: every
+// jump target becomes a relocation and exports and imports become symbols.
+class Assembler {
+public:
+    Assembler(ObjectFile* object, bool is_module, bool echo)
+            : object_(object), is_module_(is_module), echo_(echo) {
+    }
+
+    int Assemble(std::string_view source, size_t threads_count) {
+        // Echoed lines have to come out in order, and tiny chunks are not worth a thread.
+        size_t max_chunks = echo_ ? 1 : std::max<size_t>(1, source.size() / MIN_CHUNK_SIZE);
+        std::vector<Chunk> chunks = SplitSource(source, std::min(threads_count, max_chunks));
+        ForEachInParallel(chunks.size(), [&](size_t i) {
+            ChunkAssembler(&chunks[i], echo_).Assemble();
+        });
+
+        if (MergeChunks(chunks) == -1 || MakeSymbols() == -1) {
             std::cout << "Assembling terminated\n";
-            if (!is_for_label) {
-                fclose(output);
+            return -1;
+        }
+
+        // The first chunk is already in place, only the others are copied after it.
+        object_->code = std::move(chunks[0].code);
+        object_->debug = std::move(chunks[0].debug);
+        object_->code.resize(code_size_);
+        object_->debug.resize(debug_size_);
+        std::vector<std::vector<Relocation>> relocations(chunks.size());
+        std::vector<std::string> undefined_labels(chunks.size());
+        ForEachInParallel(chunks.size(), [&](size_t i) {
+            undefined_labels[i] = PlaceChunk(chunks[i], &relocations[i]);
+        });
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            if (!undefined_labels[i].empty()) {
+                std::cout << "Undefined label: " << undefined_labels[i] << "\n";
+                std::cout << "Assembling terminated\n";
+                return -1;
+            }
+            object_->relocations.insert(object_->relocations.end(), relocations[i].begin(),
+                                        relocations[i].end());
+        }
+        return 0;
+    }
+
+private:
+    static constexpr size_t MIN_CHUNK_SIZE = 1 << 16;
+
+    static std::vector<Chunk> SplitSource(std::string_view source, size_t chunks_count) {
+        std::vector<Chunk> chunks(chunks_count);
+        size_t begin = 0;
+        for (size_t i = 0; i < chunks_count; ++i) {
+            size_t end = source.size();
+            if (i + 1 < chunks_count) {
+                end = source.find('\n', std::max(begin, source.size() / chunks_count * (i + 1)));
+                end = end == std::string_view::npos ? source.size() : end + 1;
             }
+            chunks[i].source = source.substr(begin, end - begin);
+            begin = end;
+        }
+        return chunks;
+    }
+
+    // Places the chunks one after another and defines their labels in source order.
+    // Reports the error on the earliest line, as the serial pass over the source would.
+    int MergeChunks(std::vector<Chunk>& chunks) {
+        AssemblyError error;
+        uint32_t first_line = 0;
+        uint32_t source_line = 0;
+        for (auto& chunk : chunks) {
+            chunk.base = code_size_;
+            chunk.debug_base = debug_size_;
+            chunk.first_line = first_line;
+            chunk.inherited_source_line = source_line;
+            code_size_ += chunk.code.size();
+            debug_size_ += chunk.debug.size();
+            first_line += chunk.lines_count;
+            if (chunk.has_source_line) {
+                source_line = chunk.source_line;
+            }
+        }
+
+        for (auto& chunk : chunks) {
+            for (const auto& label : chunk.numbered_labels) {
+                if (!labels_.Define(label.label, chunk.base + label.offset)) {
+                    SetEarlierError({AssemblyStatus::DUPLICATE_LABEL, chunk.first_line + label.asm_line,
+                                     "LABEL", label.line}, &error);
+                    break;
+                }
+            }
+
+            for (const auto& label : chunk.named_labels.Labels()) {
+                size_t index = named_labels_.Find(label.name);
+                chunk.global_name_index.push_back(index);
+                NamedLabel& merged = named_labels_[index];
+                if (label.offset != LabelTable::UNDEFINED) {
+                    if (merged.offset != LabelTable::UNDEFINED) {
+                        SetEarlierError({AssemblyStatus::DUPLICATE_LABEL, chunk.first_line + label.asm_line,
+                                         "LABEL", label.line}, &error);
+                    }
+                    merged.offset = chunk.base + label.offset;
+                }
+                merged.is_exported |= label.is_exported;
+                merged.is_imported |= label.is_imported;
+            }
+
+            if (chunk.error.status != AssemblyStatus::OK) {
+                AssemblyError chunk_error = chunk.error;
+                chunk_error.asm_line += chunk.first_line;
+                SetEarlierError(chunk_error, &error);
+            }
+        }
+
+        if (error.status != AssemblyStatus::OK) {
+            ReportError(error);
             return -1;
-        } else {
-            Command command = static_cast<Command>(instruction[0]);
-            if (is_for_label) {
-                if (command == LABEL) {
-                    instruction_number_by_label[static_cast<int>(instruction[1])] = cur_program_size;
-                } else {
-                    cur_program_size += instruction.size();
+        }
+        return 0;
+    }
+
+    static void SetEarlierError(const AssemblyError& candidate, AssemblyError* error) {
+        if (error->status == AssemblyStatus::OK || candidate.asm_line < error->asm_line) {
+            *error = candidate;
+        }
+    }
+
+    // Symbols are listed in the order their names first appear in the source, so the
+    // same source always gives the same object.
+    int MakeSymbols() {
+        for (auto& label : named_labels_.Labels()) {
+            bool is_defined = label.offset != LabelTable::UNDEFINED;
+            if (label.is_imported && is_defined) {
+                std::cout << "Imported label is also defined: " << label.name << "\n";
+                return -1;
+            }
+            if (label.is_exported && !is_defined) {
+                std::cout << "Exported label is not defined: " << label.name << "\n";
+                return -1;
+            }
+            if (label.is_imported && !is_module_) {
+                std::cout << "Imported label " << label.name << " needs dedld, assemble with -c\n";
+                return -1;
+            }
+            if (is_module_ && (label.is_imported || label.is_exported)) {
+                label.symbol = object_->symbols.size();
+                object_->symbols.push_back({std::string(label.name), label.is_imported ? 0 : label.offset,
+                                            label.is_imported});
+            }
+        }
+        return 0;
+    }
+
+    // Copies the chunk into its place in the object and patches its jump targets.
+    // Returns the name of the first undefined label the chunk jumps to, or an empty
+    // string.
+    std::string PlaceChunk(const Chunk& chunk, std::vector<Relocation>* relocations) const {
+        std::copy(chunk.code.begin(), chunk.code.end(), object_->code.begin() + chunk.base);
+        for (size_t i = 0; i < chunk.debug.size(); ++i) {
+            DebugEntry entry = chunk.debug[i];
+            entry.offset += chunk.base;
+            entry.asm_line += chunk.first_line;
+            if (i < chunk.inherited_lines_count) {
+                entry.source_line = chunk.inherited_source_line;
+            }
+            object_->debug[chunk.debug_base + i] = entry;
+        }
+
+        for (const auto& fixup : chunk.fixups) {
+            size_t offset = LabelTable::UNDEFINED;
+            uint64_t symbol = LOCAL_SYMBOL;
+            if (fixup.name_index == NO_SYMBOL) {
+                offset = labels_.Find(fixup.label);
+                if (offset == LabelTable::UNDEFINED) {
+                    return std::to_string(fixup.label);
                 }
             } else {
-                if (RequiresLabel(command)) {
-                    instruction[1] = instruction_number_by_label[instruction[1]];
-                }
-                if (command != LABEL) {
-                    fwrite(instruction.data(), sizeof(instruction[0]), instruction.size(), output);
+                const NamedLabel& label = named_labels_[chunk.global_name_index[fixup.name_index]];
+                if (label.is_imported) {
+                    offset = 0;
+                    symbol = label.symbol;
+                } else if (label.offset == LabelTable::UNDEFINED) {
+                    return std::string(label.name);
+                } else {
+                    offset = label.offset;
                 }
             }
+            object_->code[chunk.base + fixup.offset] = static_cast<double>(offset);
+            if (is_module_) {
+                relocations->push_back({chunk.base + fixup.offset, symbol});
+            }
         }
+        return std::string();
     }
-    if (!is_for_label) {
-        fclose(output);
+
+    static void ReportError(const AssemblyError& error) {
+        if (error.status == AssemblyStatus::INVALID_NAME) {
+            std::cout << "Invalid command: " << error.name << "\n";
+        } else if (error.status == AssemblyStatus::INVALID_ARGS_CNT) {
+            std::cout << "Invalid number of arguments for command: " << error.name << "\n";
+        } else if (error.status == AssemblyStatus::INVALID_REGISTER) {
+            std::cout << "Invalid register in command: " << error.line << "\n";
+        } else if (error.status == AssemblyStatus::INVALID_NUMBER) {
+            std::cout << "Invalid number in command: " << error.line << "\n";
+        } else if (error.status == AssemblyStatus::INVALID_ADDRESS) {
+            std::cout << "Invalid memory address in command: " << error.line << "\n";
+        } else if (error.status == AssemblyStatus::INVALID_SYMBOL) {
+            std::cout << "Invalid symbol in command: " << error.line << "\n";
+        } else if (error.status == AssemblyStatus::DUPLICATE_LABEL) {
+            std::cout << "Label defined twice: " << error.line << "\n";
+        }
     }
-    return 0;
+
+    ObjectFile* object_;
+    bool is_module_;
+    bool echo_;
+    LabelTable labels_;
+    NamedLabels named_labels_;
+    size_t code_size_ = 0;
+    size_t debug_size_ = 0;
+};
+
+// Bumped whenever the assembler starts to encode some source differently.
+const char* ASSEMBLER_VERSION = "2";
+
+// Everything the output depends on besides the source and the options, for the build
+// cache key: the assembler and object format versions and the whole opcode table.
+std::string ToolVersion() {
+    std::string version = std::string("assembler ") + ASSEMBLER_VERSION + " object " +
+                          std::to_string(OBJECT_VERSION);
+    for (const auto& info : command_table) {
+        version += ' ';
+        version += info.name;
+        for (auto kind : info.operands) {
+            version += static_cast<char>('0' + static_cast<int>(kind));
+        }
+        version += static_cast<char>('0' + info.flags);
+    }
+    return version;
+}
+
+// Modules are written next to their source with the extension replaced by .o.
+std::string ModuleName(const std::string& input_name) {
+    size_t slash = input_name.find_last_of('/');
+    size_t dot = input_name.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return input_name + ".o";
+    }
+    return input_name.substr(0, dot) + ".o";
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        std::cout << "Invalid count of arguments.\n Enter name of input file\n";
-        return 0;
+    const std::string value_type_option("--value-type=");
+    const std::string cache_option("--cache=");
+
+    std::string input_name;
+    std::string output_name;
+    ValueType value_type = ValueType::DOUBLE;
+    bool is_module = false;
+    bool echo = false;
+    size_t threads_count = 1;
+    std::string cache_directory;
+    bool is_valid = true;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, value_type_option.size(), value_type_option) == 0) {
+            if (!ParseValueType(arg.substr(value_type_option.size()), &value_type)) {
+                std::cout << "Unknown value type: " << arg.substr(value_type_option.size()) << "\n";
+                return 0;
+            }
+        } else if (arg == "--echo") {
+            echo = true;
+        } else if (arg == "--cache") {
+            cache_directory = BuildCache::DefaultDirectory();
+        } else if (arg.compare(0, cache_option.size(), cache_option) == 0) {
+            cache_directory = arg.substr(cache_option.size());
+        } else if (arg.compare(0, 2, "-j") == 0) {
+            threads_count = std::thread::hardware_concurrency();
+            const char* end = arg.data() + arg.size();
+            if (arg.size() > 2 && std::from_chars(arg.data() + 2, end, threads_count).ptr != end) {
+                is_valid = false;
+            }
+            threads_count = std::max<size_t>(threads_count, 1);
+        } else if (arg == "-c") {
+            is_module = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (input_name.empty()) {
+            input_name = arg;
+        } else {
+            is_valid = false;
+        }
     }
 
-    std::string input_name(argv[1]);
-    std::string output_name("a.o");
+    if (input_name.empty() || !is_valid) {
+        std::cout << "Invalid count of arguments.\n Enter name of input file [-c] [-o output] [-j[threads]] "
+                     "[--value-type=double|float32|int64|long-double] [--echo] [--cache[=directory]]\n";
+        return 0;
+    }
+    if (output_name.empty()) {
+        output_name = is_module ? ModuleName(input_name) : "a.o";
+    }
 
-    std::string buffer;
-    if (ReadFile(input_name, buffer) == -1) {
+    MappedFile input;
+    if (input.Open(input_name) == -1) {
         std::cout << "Invalid filename\n";
         return 0;
     }
 
-    std::unordered_map<int, size_t> instruction_number_by_label;
+    BuildCache cache(cache_directory);
+    std::string key;
+    if (!cache_directory.empty()) {
+        std::string options = std::string(value_type_names[static_cast<size_t>(value_type)]) +
+                              (is_module ? " -c" : "");
+        key = BuildCache::MakeKey(ToolVersion(), options, input.Data(), input.Size());
+        if (cache.Fetch(key, output_name)) {
+            cache.PrintStats(true, &std::cout);
+            return 0;
+        }
+    }
 
-    if (ScanInstructions(buffer, true, "", instruction_number_by_label) == -1) {
-        return 0;
+    ObjectFile object;
+    SetValueType(&object, value_type);
+    if (is_module) {
+        object.flags |= LINKABLE;
     }
 
-    ScanInstructions(buffer, false, output_name, instruction_number_by_label);
+    Assembler assembler(&object, is_module, echo);
+    if (assembler.Assemble(std::string_view(input.Data(), input.Size()), threads_count) == -1) {
+        return 0;
+    }
+    if (WriteObject(output_name, object) == -1) {
+        std::cout << "Can not write " << output_name << "\n";
+        return 0;
+    }
+    if (!cache_directory.empty()) {
+        if (cache.Store(key, output_name) == -1) {
+            std::cout << "Can not write build cache " << cache_directory << "\n";
+        }
+        cache.PrintStats(false, &std::cout);
+    }
     return 0;
-}
\ No newline at end of file
+}
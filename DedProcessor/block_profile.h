@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+
+// Execution counts per code offset. For jumps taken counts how many of the
+// executions transferred control, so executed - taken is the fall-through count.
+struct BlockProfile {
+    std::vector<uint64_t> executed;
+    std::vector<uint64_t> taken;
+};
+
+// Profile file layout: the size of the profiled code in words on the first line, then
+// "offset executed taken" for every instruction that was executed at least once.
+int WriteBlockProfile(const std::string& filename, const BlockProfile& profile) {
+    std::ofstream output(filename);
+    if (!output) {
+        return -1;
+    }
+    output << profile.executed.size() << "\n";
+    for (size_t offset = 0; offset < profile.executed.size(); ++offset) {
+        if (profile.executed[offset] != 0) {
+            output << offset << " " << profile.executed[offset] << " " << profile.taken[offset] << "\n";
+        }
+    }
+    return output ? 0 : -1;
+}
+
+int ReadBlockProfile(const std::string& filename, size_t code_size, BlockProfile* profile) {
+    std::ifstream input(filename);
+    size_t profiled_size = 0;
+    if (!(input >> profiled_size) || profiled_size != code_size) {
+        return -1;
+    }
+
+    profile->executed.assign(code_size, 0);
+    profile->taken.assign(code_size, 0);
+    size_t offset = 0;
+    uint64_t executed = 0;
+    uint64_t taken = 0;
+    while (input >> offset >> executed >> taken) {
+        if (offset >= code_size) {
+            return -1;
+        }
+        profile->executed[offset] = executed;
+        profile->taken[offset] = taken;
+    }
+    return input.eof() ? 0 : -1;
+}
+
+// Dispatch loop hook that counts executions of every instruction and, for jumps,
+// how often control did not continue with the next instruction.
+template <class State>
+class BlockProfiler {
+public:
+    BlockProfiler(size_t code_size, const State* state) : state_(state) {
+        profile_.executed.assign(code_size, 0);
+        profile_.taken.assign(code_size, 0);
+    }
+
+    void BeforeCommand(Command command, size_t offset) {
+    }
+
+    void AfterCommand(Command command, size_t offset) {
+        ++profile_.executed[offset];
+        if (RequiresLabel(command) && command != CALL) {
+            ++jumps_;
+            if (state_->instruction_pointer != offset + 1 + ArgsCount(command)) {
+                ++profile_.taken[offset];
+                ++taken_jumps_;
+            }
+        }
+    }
+
+    const BlockProfile& Profile() const {
+        return profile_;
+    }
+
+    uint64_t JumpsCount() const {
+        return jumps_;
+    }
+
+    uint64_t TakenJumpsCount() const {
+        return taken_jumps_;
+    }
+
+private:
+    const State* state_;
+    BlockProfile profile_;
+    uint64_t jumps_ = 0;
+    uint64_t taken_jumps_ = 0;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Content-addressed cache of tool outputs in a local directory. An entry is named by
+// the hash of everything the output depends on: the tool and its version, the options
+// that change the output and the input bytes. Entries and outputs are written to a
+// temporary file and renamed into place, so a crashed or concurrent build never sees
+// half a file. Hits refresh the entry's modification time and stores evict the entries
+// used least recently until the cache fits its size bound.
+class BuildCache {
+public:
+    static constexpr uint64_t DEFAULT_MAX_SIZE = 256ull << 20;
+
+    explicit BuildCache(std::string directory, uint64_t max_size = DEFAULT_MAX_SIZE)
+            : directory_(std::move(directory)), max_size_(max_size) {
+    }
+
+    // $DED_CACHE_DIR, or ded in $XDG_CACHE_HOME or ~/.cache.
+    static std::string DefaultDirectory() {
+        if (const char* directory = std::getenv("DED_CACHE_DIR")) {
+            return directory;
+        }
+        if (const char* cache_home = std::getenv("XDG_CACHE_HOME")) {
+            return std::string(cache_home) + "/ded";
+        }
+        const char* home = std::getenv("HOME");
+        return std::string(home != nullptr ? home : ".") + "/.cache/ded";
+    }
+
+    // 128-bit key as 32 hex digits. tool should change with every change to the tool
+    // that changes its output.
+    static std::string MakeKey(std::string_view tool, std::string_view options, const char* data,
+                               size_t size) {
+        uint64_t lanes[2] = {0x243f6a8885a308d3ull, 0x13198a2e03707344ull};
+        for (auto& lane : lanes) {
+            lane = HashBytes(tool.data(), tool.size(), lane);
+            lane = HashBytes(options.data(), options.size(), lane);
+            lane = HashBytes(data, size, lane);
+        }
+
+        std::string key;
+        char digits[17];
+        for (auto lane : lanes) {
+            std::snprintf(digits, sizeof(digits), "%016llx", static_cast<unsigned long long>(lane));
+            key += digits;
+        }
+        return key;
+    }
+
+    // Copies the entry for key to output_name and returns true on a hit.
+    bool Fetch(const std::string& key, const std::string& output_name) {
+        std::string entry = EntryName(key);
+        bool is_hit = CopyFile(entry, output_name);
+        if (is_hit) {
+            utimensat(AT_FDCWD, entry.data(), nullptr, 0);
+        }
+        UpdateStats(is_hit);
+        return is_hit;
+    }
+
+    // Stores the file output_name as the entry for key. Returns -1 if the cache
+    // directory can not be written.
+    int Store(const std::string& key, const std::string& output_name) {
+        if (!MakeDirectories() || !CopyFile(output_name, EntryName(key))) {
+            return -1;
+        }
+        Evict();
+        return 0;
+    }
+
+    // Hit and miss counts of all builds that used the directory, and its size.
+    void PrintStats(bool is_hit, std::ostream* out) const {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        ReadStats(&hits, &misses);
+        uint64_t size = 0;
+        size_t entries_count = ListEntries(&size).size();
+        uint64_t lookups = hits + misses;
+        *out << "Build cache " << (is_hit ? "hit" : "miss") << ": " << hits << " hits, " << misses
+             << " misses (" << (lookups == 0 ? 0 : hits * 100 / lookups) << "% hit rate), "
+             << entries_count << " entries, " << size / 1024 << " KB in " << directory_ << "\n";
+    }
+
+private:
+    struct Entry {
+        std::string name;
+        uint64_t size;
+        timespec used;
+    };
+
+    static uint64_t Mix(uint64_t value) {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdull;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ull;
+        value ^= value >> 33;
+        return value;
+    }
+
+    // Eight bytes per step, so hashing even large inputs costs little next to reading them.
+    static uint64_t HashBytes(const char* data, size_t size, uint64_t seed) {
+        uint64_t hash = Mix(seed ^ size);
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = Mix(hash ^ word) + seed;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, data + i, size - i);
+        return Mix(hash ^ tail ^ (size - i));
+    }
+
+    std::string EntriesDirectory() const {
+        return directory_ + "/entries";
+    }
+
+    std::string EntryName(const std::string& key) const {
+        return EntriesDirectory() + "/" + key;
+    }
+
+    bool MakeDirectories() const {
+        for (size_t slash = directory_.find('/', 1); slash != std::string::npos;
+             slash = directory_.find('/', slash + 1)) {
+            mkdir(directory_.substr(0, slash).data(), 0755);
+        }
+        mkdir(directory_.data(), 0755);
+        return mkdir(EntriesDirectory().data(), 0755) == 0 || errno == EEXIST;
+    }
+
+    // Writes a copy of from next to to and renames it into place.
+    static bool CopyFile(const std::string& from, const std::string& to) {
+        int input = open(from.data(), O_RDONLY);
+        if (input == -1) {
+            return false;
+        }
+        std::string temporary = to + ".tmp." + std::to_string(getpid());
+        int output = open(temporary.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output == -1) {
+            close(input);
+            return false;
+        }
+
+        bool is_ok = true;
+        std::vector<char> buffer(1 << 20);
+        ssize_t count;
+        while ((count = read(input, buffer.data(), buffer.size())) > 0) {
+            is_ok &= write(output, buffer.data(), count) == count;
+        }
+        is_ok &= count == 0;
+        close(input);
+        is_ok &= close(output) == 0;
+        is_ok = is_ok && rename(temporary.data(), to.data()) == 0;
+        if (!is_ok) {
+            unlink(temporary.data());
+        }
+        return is_ok;
+    }
+
+    std::vector<Entry> ListEntries(uint64_t* total_size) const {
+        std::vector<Entry> entries;
+        *total_size = 0;
+        DIR* directory = opendir(EntriesDirectory().data());
+        if (directory == nullptr) {
+            return entries;
+        }
+        while (dirent* item = readdir(directory)) {
+            std::string name = EntriesDirectory() + "/" + item->d_name;
+            struct stat statbuf;
+            if (item->d_name[0] == '.' || std::strstr(item->d_name, ".tmp.") != nullptr ||
+                stat(name.data(), &statbuf) == -1) {
+                continue;
+            }
+            entries.push_back({name, static_cast<uint64_t>(statbuf.st_size), statbuf.st_mtim});
+            *total_size += statbuf.st_size;
+        }
+        closedir(directory);
+        return entries;
+    }
+
+    void Evict() const {
+        uint64_t size = 0;
+        auto entries = ListEntries(&size);
+        if (size <= max_size_) {
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+            return lhs.used.tv_sec != rhs.used.tv_sec ? lhs.used.tv_sec < rhs.used.tv_sec
+                                                      : lhs.used.tv_nsec < rhs.used.tv_nsec;
+        });
+        for (const auto& entry : entries) {
+            if (size <= max_size_) {
+                break;
+            }
+            if (unlink(entry.name.data()) == 0) {
+                size -= entry.size;
+            }
+        }
+    }
+
+    std::string StatsName() const {
+        return directory_ + "/stats";
+    }
+
+    void ReadStats(uint64_t* hits, uint64_t* misses) const {
+        FILE* file = std::fopen(StatsName().data(), "r");
+        if (file == nullptr) {
+            return;
+        }
+        unsigned long long read_hits = 0;
+        unsigned long long read_misses = 0;
+        if (std::fscanf(file, "%llu %llu", &read_hits, &read_misses) == 2) {
+            *hits = read_hits;
+            *misses = read_misses;
+        }
+        std::fclose(file);
+    }
+
+    // The counts are shared by concurrent builds, so they are updated under a lock.
+    void UpdateStats(bool is_hit) const {
+        if (!MakeDirectories()) {
+            return;
+        }
+        int fd = open(StatsName().data(), O_RDWR | O_CREAT, 0644);
+        if (fd == -1) {
+            return;
+        }
+        flock(fd, LOCK_EX);
+        char text[64] = {};
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+        if (pread(fd, text, sizeof(text) - 1, 0) > 0) {
+            std::sscanf(text, "%llu %llu", &hits, &misses);
+        }
+        ++(is_hit ? hits : misses);
+        int length = std::snprintf(text, sizeof(text), "%llu %llu\n", hits, misses);
+        if (ftruncate(fd, 0) == 0) {
+            pwrite(fd, text, length, 0);
+        }
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    std::string directory_;
+    uint64_t max_size_;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "commands.h"
+#include "heap.h"
+#include "object.h"
+
+struct Instruction {
+    Command command;
+    std::vector<double> args;
+    size_t offset;
+    uint32_t asm_line = 0;
+    uint32_t source_line = 0;
+};
+
+bool IsJump(Command command) {
+    return RequiresLabel(command);
+}
+
+bool IsConditionalJump(Command command) {
+    return command == JE || command == JN || command == JL || command == JG || command == JGE ||
+           command == JLE || command == RJE || command == RJN || command == RJL || command == RJG;
+}
+
+// Jumps and calls keep their target in the last operand.
+size_t JumpTarget(const Instruction& instruction) {
+    return static_cast<size_t>(instruction.args.back());
+}
+
+bool EndsBlock(Command command) {
+    return IsJump(command) || command == RET || command == END;
+}
+
+// The processor indexes its memory and registers with these operands as they are, so
+// a memory address must be inside the VM memory and a register must exist.
+bool IsValidOperand(Command command, size_t index, double operand) {
+    if (IsAddressOperand(command, index)) {
+        return operand >= 0 && operand < MEMORY_SIZE;
+    } else if (IsRegisterOperand(command, index)) {
+        return operand >= 0 && operand < REGISTERS_COUNT;
+    }
+    return true;
+}
+
+// Returns the offset of the first instruction with an operand that is not valid, -1
+// if there is none. The processor runs only code that passes this check.
+long long FindInvalidOperand(const std::vector<double>& code) {
+    for (size_t i = 0; i < code.size();) {
+        size_t offset = i;
+        auto command = static_cast<Command>(code[i]);
+        ++i;
+        for (size_t j = 0; j < ArgsCount(command) && i < code.size(); ++j, ++i) {
+            if (!IsValidOperand(command, j, code[i])) {
+                return static_cast<long long>(offset);
+            }
+        }
+    }
+    return -1;
+}
+
+// Returns false for a program with an operand that is not valid.
+bool DecodeProgram(const std::vector<double>& buffer, std::vector<Instruction>* program) {
+    program->clear();
+    for (size_t i = 0; i < buffer.size();) {
+        Instruction instruction;
+        instruction.offset = i;
+        instruction.command = static_cast<Command>(buffer[i]);
+        ++i;
+
+        for (size_t j = ArgsCount(instruction.command); j > 0 && i < buffer.size(); --j) {
+            if (!IsValidOperand(instruction.command, instruction.args.size(), buffer[i])) {
+                std::cout << "Invalid operand at offset " << instruction.offset << "\n";
+                return false;
+            }
+            instruction.args.emplace_back(buffer[i]);
+            ++i;
+        }
+        program->emplace_back(instruction);
+    }
+    return true;
+}
+
+bool DecodeProgram(const ObjectFile& object, std::vector<Instruction>* program) {
+    if (!DecodeProgram(object.code, program)) {
+        return false;
+    }
+    for (auto& instruction : *program) {
+        const DebugEntry* entry = FindDebugEntry(object.debug, instruction.offset);
+        if (entry != nullptr && entry->offset == instruction.offset) {
+            instruction.asm_line = entry->asm_line;
+            instruction.source_line = entry->source_line;
+        }
+    }
+    return true;
+}
+
+// Returns the index of the instruction starting at offset, program.size() for the
+// offset right after the last instruction and -1 if offset is not an instruction boundary.
+long long FindInstructionByOffset(const std::vector<Instruction>& program, size_t offset) {
+    auto found = std::lower_bound(program.begin(), program.end(), offset,
+                                  [](const Instruction& instruction, size_t value) {
+                                      return instruction.offset < value;
+                                  });
+    if (found == program.end()) {
+        if (program.empty() || offset == program.back().offset + 1 + program.back().args.size()) {
+            return static_cast<long long>(program.size());
+        }
+        return -1;
+    }
+    if (found->offset != offset) {
+        return -1;
+    }
+    return found - program.begin();
+}
+
+// Marks the instructions that start a basic block: the entry point, every jump or call
+// target and every instruction that follows a jump, call, return or end.
+std::vector<bool> FindLeaders(const std::vector<Instruction>& program) {
+    std::vector<bool> is_leader(program.size() + 1, false);
+    is_leader[0] = true;
+    for (size_t i = 0; i < program.size(); ++i) {
+        Command command = program[i].command;
+        if (IsJump(command)) {
+            long long target = FindInstructionByOffset(program, JumpTarget(program[i]));
+            if (target != -1) {
+                is_leader[target] = true;
+            }
+        }
+        if (EndsBlock(command)) {
+            is_leader[i + 1] = true;
+        }
+    }
+    return is_leader;
+}
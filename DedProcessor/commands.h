@@ -1,168 +1,263 @@
 #pragma once
 
-#include <unordered_set>
-#include <unordered_map>
-#include <string>
-
-enum Command {
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    SQRT,
-
-    JUMP,
-    JE,
-    JN,
-    JL,
-    JG,
-
-    PUSH,
-    POP,
-    MOV_STOA,
-    MOV_STOB,
-    MOV_STOC,
-    MOV_STOD,
-    MOV_STOMEM,
-    MOV_ATOS,
-    MOV_BTOS,
-    MOV_CTOS,
-    MOV_DTOS,
-    MOV_MEMTOS,
-
-    IN,
-    OUT,
-
-    CALL,
-    RET,
-    END,
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
 
+// Kind of every operand in the code: a plain number, a register number r0..r15, a
+// memory cell index or the offset of a jump or call target (written as a label in
+// assembler source).
+enum class OperandKind {
+    NONE,
+    NUMBER,
+    REGISTER,
+    ADDRESS,
     LABEL
 };
 
-std::unordered_set<Command> no_arg_commands = {
-        ADD,
-        SUB,
-        MUL,
-        DIV,
-        SQRT,
-        POP,
-        MOV_STOA,
-        MOV_STOB,
-        MOV_STOC,
-        MOV_STOD,
-        MOV_ATOS,
-        MOV_BTOS,
-        MOV_CTOS,
-        MOV_DTOS,
-        IN,
-        OUT,
-        RET,
-        END
-};
+// LABEL, LINE, EXPORT and IMPORT only steer the assembler and never appear in the code.
+const uint32_t DIRECTIVE = 1;
 
-std::unordered_set<Command> one_arg_commands = {
-        MOV_STOMEM,
-        MOV_MEMTOS,
-        JUMP,
-        JE,
-        JN,
-        JL,
-        JG,
-        PUSH,
-        CALL,
-        LABEL
-};
+// The whole ISA, one opcode per line: name, kinds of up to three operands and flags.
+// Opcodes are numbered in this order and stored in the code as doubles, so new ones go
+// to the end. JGE and JLE jump exactly when JL and JG do not, also for NaN, so every
+// stack conditional jump has an inverse; of the register ones only RJE and RJN do.
+#define DED_COMMANDS(X)                                      \
+    X(ADD,         NONE,     NONE,     NONE,     0)          \
+    X(SUB,         NONE,     NONE,     NONE,     0)          \
+    X(MUL,         NONE,     NONE,     NONE,     0)          \
+    X(DIV,         NONE,     NONE,     NONE,     0)          \
+    X(SQRT,        NONE,     NONE,     NONE,     0)          \
+                                                             \
+    X(JUMP,        LABEL,    NONE,     NONE,     0)          \
+    X(JE,          LABEL,    NONE,     NONE,     0)          \
+    X(JN,          LABEL,    NONE,     NONE,     0)          \
+    X(JL,          LABEL,    NONE,     NONE,     0)          \
+    X(JG,          LABEL,    NONE,     NONE,     0)          \
+                                                             \
+    X(PUSH,        NUMBER,   NONE,     NONE,     0)          \
+    X(POP,         NONE,     NONE,     NONE,     0)          \
+    X(MOV_STOA,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_STOB,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_STOC,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_STOD,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_STOMEM,  ADDRESS,  NONE,     NONE,     0)          \
+    X(MOV_ATOS,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_BTOS,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_CTOS,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_DTOS,    NONE,     NONE,     NONE,     0)          \
+    X(MOV_MEMTOS,  ADDRESS,  NONE,     NONE,     0)          \
+                                                             \
+    X(IN,          NONE,     NONE,     NONE,     0)          \
+    X(OUT,         NONE,     NONE,     NONE,     0)          \
+                                                             \
+    X(CALL,        LABEL,    NONE,     NONE,     0)          \
+    X(RET,         NONE,     NONE,     NONE,     0)          \
+    X(END,         NONE,     NONE,     NONE,     0)          \
+                                                             \
+    X(LABEL,       LABEL,    NONE,     NONE,     DIRECTIVE)  \
+                                                             \
+    X(DUP,         NONE,     NONE,     NONE,     0)          \
+                                                             \
+    X(ALLOC,       NUMBER,   NONE,     NONE,     0)          \
+    X(FREE,        NONE,     NONE,     NONE,     0)          \
+    X(ARENA_ALLOC, NUMBER,   NONE,     NONE,     0)          \
+    X(ARENA_RESET, NONE,     NONE,     NONE,     0)          \
+    X(LOAD,        NONE,     NONE,     NONE,     0)          \
+    X(STORE,       NONE,     NONE,     NONE,     0)          \
+                                                             \
+    X(LINE,        NUMBER,   NONE,     NONE,     DIRECTIVE)  \
+                                                             \
+    X(RADD,        REGISTER, REGISTER, REGISTER, 0)          \
+    X(RSUB,        REGISTER, REGISTER, REGISTER, 0)          \
+    X(RMUL,        REGISTER, REGISTER, REGISTER, 0)          \
+    X(RDIV,        REGISTER, REGISTER, REGISTER, 0)          \
+    X(RSET,        REGISTER, NUMBER,   NONE,     0)          \
+    X(RMOV,        REGISTER, REGISTER, NONE,     0)          \
+    X(RLOAD,       REGISTER, ADDRESS,  NONE,     0)          \
+    X(RSTORE,      REGISTER, ADDRESS,  NONE,     0)          \
+    X(RPUSH,       REGISTER, NONE,     NONE,     0)          \
+    X(RPOP,        REGISTER, NONE,     NONE,     0)          \
+    X(RJE,         REGISTER, REGISTER, LABEL,    0)          \
+    X(RJN,         REGISTER, REGISTER, LABEL,    0)          \
+    X(RJL,         REGISTER, REGISTER, LABEL,    0)          \
+    X(RJG,         REGISTER, REGISTER, LABEL,    0)          \
+                                                             \
+    X(ENTER,       NUMBER,   NONE,     NONE,     0)          \
+    X(LEAVE,       NONE,     NONE,     NONE,     0)          \
+    X(LOAD_LOCAL,  NUMBER,   NONE,     NONE,     0)          \
+    X(STORE_LOCAL, NUMBER,   NONE,     NONE,     0)          \
+                                                             \
+    X(EXPORT,      LABEL,    NONE,     NONE,     DIRECTIVE)  \
+    X(IMPORT,      LABEL,    NONE,     NONE,     DIRECTIVE)  \
+                                                             \
+    X(JGE,         LABEL,    NONE,     NONE,     0)          \
+    X(JLE,         LABEL,    NONE,     NONE,     0)
 
-std::unordered_map<std::string, Command> command_by_name = {
-        {"ADD", ADD},
-        {"SUB", SUB},
-        {"MUL", MUL},
-        {"DIV", DIV},
-        {"SQRT", SQRT},
-
-        {"JUMP", JUMP},
-        {"JE", JE},
-        {"JN", JN},
-        {"JL", JL},
-        {"JG", JG},
-
-        {"PUSH", PUSH},
-        {"POP", POP},
-        {"MOV_STOA", MOV_STOA},
-        {"MOV_STOB", MOV_STOB},
-        {"MOV_STOC", MOV_STOC},
-        {"MOV_STOD", MOV_STOD},
-        {"MOV_STOMEM", MOV_STOMEM},
-        {"MOV_ATOS", MOV_ATOS},
-        {"MOV_BTOS", MOV_BTOS},
-        {"MOV_CTOS", MOV_CTOS},
-        {"MOV_DTOS", MOV_DTOS},
-        {"MOV_MEMTOS", MOV_MEMTOS},
-
-        {"IN", IN},
-        {"OUT", OUT},
-
-        {"CALL", CALL},
-        {"RET", RET},
-        {"END", END},
-
-        {"LABEL", LABEL}
+enum Command {
+#define DED_COMMAND_ENUM(name, first, second, third, flags) name,
+    DED_COMMANDS(DED_COMMAND_ENUM)
+#undef DED_COMMAND_ENUM
 };
 
-std::unordered_map<Command, std::string> name_by_command {
-        {ADD, "ADD"},
-        {SUB, "SUB"},
-        {MUL, "MUL"},
-        {DIV, "DIV"},
-        {SQRT, "SQRT"},
-
-        {JUMP, "JUMP"},
-        {JE, "JE"},
-        {JN, "JN"},
-        {JL, "JL"},
-        {JG, "JG"},
-
-        {PUSH, "PUSH"},
-        {POP, "POP"},
-        {MOV_STOA, "MOV_STOA"},
-        {MOV_STOB, "MOV_STOB"},
-        {MOV_STOC, "MOV_STOC"},
-        {MOV_STOD, "MOV_STOD"},
-        {MOV_STOMEM, "MOV_STOMEM"},
-        {MOV_ATOS, "MOV_ATOS"},
-        {MOV_BTOS, "MOV_BTOS"},
-        {MOV_CTOS, "MOV_CTOS"},
-        {MOV_DTOS, "MOV_DTOS"},
-        {MOV_MEMTOS, "MOV_MEMTOS"},
-
-        {IN, "IN"},
-        {OUT, "OUT"},
-
-        {CALL, "CALL"},
-        {RET, "RET"},
-        {END, "END"},
-
-        {LABEL, "LABEL"}
+const size_t REGISTERS_COUNT = 16;
+
+// Memory cells are addressed by 32-bit indices, see GuardedMemory.
+const uint64_t MEMORY_ADDRESSES_COUNT = uint64_t{1} << 32;
+
+// Locals of all frames opened by ENTER share one stack of FRAME_STACK_SIZE cells, and
+// at most FRAMES_DEPTH frames can be open at once.
+const size_t FRAME_STACK_SIZE = 1 << 16;
+const size_t FRAMES_DEPTH = 1 << 12;
+
+const size_t MAX_ARGS_COUNT = 3;
+
+struct CommandInfo {
+    std::string_view name;
+    size_t args_count;
+    OperandKind operands[MAX_ARGS_COUNT];
+    uint32_t flags;
 };
 
-std::unordered_set<Command> require_label = {
-        JUMP,
-        JE,
-        JN,
-        JL,
-        JG,
-        CALL
+constexpr CommandInfo MakeCommandInfo(std::string_view name, OperandKind first, OperandKind second,
+                                      OperandKind third, uint32_t flags) {
+    size_t args_count = (first != OperandKind::NONE) + (second != OperandKind::NONE) +
+                        (third != OperandKind::NONE);
+    return {name, args_count, {first, second, third}, flags};
+}
+
+// Metadata of every command indexed by opcode.
+constexpr CommandInfo command_table[] = {
+#define DED_COMMAND_INFO(name, first, second, third, flags) \
+    MakeCommandInfo(#name, OperandKind::first, OperandKind::second, OperandKind::third, flags),
+    DED_COMMANDS(DED_COMMAND_INFO)
+#undef DED_COMMAND_INFO
 };
 
-bool HasNoArg(Command command) {
-    return no_arg_commands.find(command) != no_arg_commands.end();
+constexpr size_t COMMANDS_COUNT = sizeof(command_table) / sizeof(command_table[0]);
+
+// Returns false for a code word that is not an opcode.
+constexpr bool IsCommand(double code) {
+    return code >= 0 && code < COMMANDS_COUNT && code == static_cast<double>(static_cast<size_t>(code));
+}
+
+constexpr const CommandInfo& GetCommandInfo(Command command) {
+    return command_table[command];
+}
+
+constexpr std::string_view CommandName(Command command) {
+    return command_table[command].name;
+}
+
+// Zero for a word that is not an opcode, so a broken program is still walked word by word.
+constexpr size_t ArgsCount(Command command) {
+    return static_cast<size_t>(command) < COMMANDS_COUNT ? command_table[command].args_count : 0;
+}
+
+// Jumps and calls keep their target in the last operand.
+constexpr bool RequiresLabel(Command command) {
+    size_t args_count = ArgsCount(command);
+    return args_count != 0 && command_table[command].operands[args_count - 1] == OperandKind::LABEL &&
+           (command_table[command].flags & DIRECTIVE) == 0;
+}
+
+constexpr bool IsRegisterOperand(Command command, size_t index) {
+    return index < ArgsCount(command) && command_table[command].operands[index] == OperandKind::REGISTER;
+}
+
+constexpr bool IsAddressOperand(Command command, size_t index) {
+    return index < ArgsCount(command) && command_table[command].operands[index] == OperandKind::ADDRESS;
 }
 
-bool HasOneArg(Command command) {
-    return one_arg_commands.find(command) != one_arg_commands.end();
+// Returns false for an operand that no 32-bit cell index equals, NaN included.
+constexpr bool IsMemoryAddress(double address) {
+    return address >= 0 && address < static_cast<double>(MEMORY_ADDRESSES_COUNT);
 }
 
-bool RequiresLabel(Command command) {
-    return require_label.find(command) != require_label.end();
-}
\ No newline at end of file
+constexpr bool IsDirective(Command command) {
+    return static_cast<size_t>(command) < COMMANDS_COUNT && (command_table[command].flags & DIRECTIVE) != 0;
+}
+
+// Returns the jump with the opposite condition or the command itself if there is none,
+// which is the case for RJL and RJG: nothing jumps exactly when they do not.
+constexpr Command InvertCondition(Command command) {
+    switch (command) {
+        case JE:
+            return JN;
+        case JN:
+            return JE;
+        case JL:
+            return JGE;
+        case JGE:
+            return JL;
+        case JG:
+            return JLE;
+        case JLE:
+            return JG;
+        case RJE:
+            return RJN;
+        case RJN:
+            return RJE;
+        default:
+            return command;
+    }
+}
+
+// Name lookup goes through a perfect hash: the seed is searched at compile time so that
+// every command name gets a slot of its own, and a lookup is one hash and one compare.
+const size_t COMMAND_HASH_SIZE = 256;
+const uint8_t NO_COMMAND = UINT8_MAX;
+static_assert(COMMANDS_COUNT < NO_COMMAND, "opcodes must fit the hash slots");
+
+constexpr uint32_t HashCommandName(std::string_view name, uint32_t seed) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (char symbol : name) {
+        hash = (hash ^ static_cast<unsigned char>(symbol)) * 16777619u;
+    }
+    return hash ^ (hash >> 16);
+}
+
+constexpr uint32_t FindCommandHashSeed() {
+    for (uint32_t seed = 0;; ++seed) {
+        bool is_used[COMMAND_HASH_SIZE] = {};
+        bool is_perfect = true;
+        for (const auto& info : command_table) {
+            size_t slot = HashCommandName(info.name, seed) % COMMAND_HASH_SIZE;
+            if (is_used[slot]) {
+                is_perfect = false;
+                break;
+            }
+            is_used[slot] = true;
+        }
+        if (is_perfect) {
+            return seed;
+        }
+    }
+}
+
+constexpr uint32_t COMMAND_HASH_SEED = FindCommandHashSeed();
+
+constexpr std::array<uint8_t, COMMAND_HASH_SIZE> BuildCommandHashTable() {
+    std::array<uint8_t, COMMAND_HASH_SIZE> slots{};
+    for (auto& slot : slots) {
+        slot = NO_COMMAND;
+    }
+    for (size_t command = 0; command < COMMANDS_COUNT; ++command) {
+        slots[HashCommandName(command_table[command].name, COMMAND_HASH_SEED) % COMMAND_HASH_SIZE] =
+                static_cast<uint8_t>(command);
+    }
+    return slots;
+}
+
+constexpr std::array<uint8_t, COMMAND_HASH_SIZE> command_hash_table = BuildCommandHashTable();
+
+// Returns false if name is not a command.
+constexpr bool FindCommand(std::string_view name, Command* command) {
+    uint8_t found = command_hash_table[HashCommandName(name, COMMAND_HASH_SEED) % COMMAND_HASH_SIZE];
+    if (found == NO_COMMAND || command_table[found].name != name) {
+        return false;
+    }
+    *command = static_cast<Command>(found);
+    return true;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Lock-free sibling of Stack for sharing work between threads: a Treiber stack. Nodes
+// come from a pool owned by the stack and are recycled through a second Treiber stack,
+// they are only given back to the system by the destructor. Links are 32-bit node
+// indices, and the head keeps a 32-bit tag next to the index that changes on every
+// update, so a plain 64-bit CAS is enough to rule out ABA. Items are copied in and out
+// of recycled nodes through relaxed atomics, so T has to be trivially copyable.
+template <class T>
+class ConcurrentStack {
+    static_assert(std::is_trivially_copyable<T>::value, "ConcurrentStack items are copied bytewise");
+
+public:
+    ConcurrentStack() = default;
+
+    ConcurrentStack(const ConcurrentStack&) = delete;
+    ConcurrentStack& operator=(const ConcurrentStack&) = delete;
+
+    ~ConcurrentStack() {
+        for (auto& chunk : chunks_) {
+            delete[] chunk.load(std::memory_order_relaxed);
+        }
+    }
+
+    void Push(T item) {
+        uint32_t index = AllocateNode();
+        GetNode(index).item.store(item, std::memory_order_relaxed);
+        PushNode(&head_, index);
+        size_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Returns false if the stack was empty.
+    bool TryPop(T* item) {
+        uint32_t index = PopNode(&head_, item);
+        if (index == NIL) {
+            return false;
+        }
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        PushNode(&free_nodes_, index);
+        return true;
+    }
+
+    void Pop() {
+        T item;
+        TryPop(&item);
+    }
+
+    // Snapshot of the top item, T() if the stack is empty; other threads may pop it
+    // before the caller looks at it.
+    T Top() const {
+        uint32_t index = Index(head_.load(std::memory_order_acquire));
+        if (index == NIL) {
+            return T();
+        }
+        return GetNode(index).item.load(std::memory_order_relaxed);
+    }
+
+    bool Empty() const {
+        return Index(head_.load(std::memory_order_acquire)) == NIL;
+    }
+
+    // Exact only while no other thread changes the stack.
+    size_t Size() const {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Node {
+        std::atomic<uint32_t> next{NIL};
+        // Atomic because a thread can still be reading the item of a node that another
+        // one has already popped and reused.
+        std::atomic<T> item;
+    };
+
+    static constexpr uint32_t NIL = UINT32_MAX;
+    // Chunk k of the pool holds CHUNK_BASE << k nodes, so 32 chunks cover every index.
+    static constexpr size_t CHUNK_BASE = 64;
+    static constexpr size_t CHUNKS_COUNT = 32;
+
+    static uint32_t Index(uint64_t head) {
+        return static_cast<uint32_t>(head);
+    }
+
+    static uint64_t Tagged(uint32_t index, uint64_t previous_head) {
+        uint64_t tag = (previous_head >> 32) + 1;
+        return (tag << 32) | index;
+    }
+
+    static size_t ChunkOf(size_t index) {
+        return 63 - __builtin_clzll(index / CHUNK_BASE + 1);
+    }
+
+    Node& GetNode(uint32_t index) const {
+        size_t chunk = ChunkOf(index);
+        size_t first = CHUNK_BASE * ((static_cast<size_t>(1) << chunk) - 1);
+        return chunks_[chunk].load(std::memory_order_acquire)[index - first];
+    }
+
+    uint32_t AllocateNode() {
+        uint32_t index = PopNode(&free_nodes_, nullptr);
+        if (index != NIL) {
+            return index;
+        }
+
+        index = next_unused_.fetch_add(1, std::memory_order_relaxed);
+        size_t chunk = ChunkOf(index);
+        if (chunks_[chunk].load(std::memory_order_acquire) == nullptr) {
+            Node* nodes = new Node[CHUNK_BASE << chunk];
+            Node* expected = nullptr;
+            if (!chunks_[chunk].compare_exchange_strong(expected, nodes, std::memory_order_acq_rel)) {
+                delete[] nodes;
+            }
+        }
+        return index;
+    }
+
+    void PushNode(std::atomic<uint64_t>* list, uint32_t index) {
+        Node& node = GetNode(index);
+        uint64_t head = list->load(std::memory_order_relaxed);
+        do {
+            node.next.store(Index(head), std::memory_order_relaxed);
+        } while (!list->compare_exchange_weak(head, Tagged(index, head), std::memory_order_release,
+                                              std::memory_order_relaxed));
+    }
+
+    // The item is read before the CAS, when another thread may already have popped the
+    // node and be writing a new item into it. The read is a relaxed atomic load, so it
+    // is a race on the value only, and the copy is handed out only if the CAS proves
+    // that the node stayed on top, and so unchanged, in the meantime.
+    uint32_t PopNode(std::atomic<uint64_t>* list, T* item) {
+        uint64_t head = list->load(std::memory_order_acquire);
+        while (Index(head) != NIL) {
+            uint32_t index = Index(head);
+            Node& node = GetNode(index);
+            uint32_t next = node.next.load(std::memory_order_relaxed);
+            T copy;
+            if (item != nullptr) {
+                copy = node.item.load(std::memory_order_relaxed);
+            }
+            if (list->compare_exchange_weak(head, Tagged(next, head), std::memory_order_acquire,
+                                            std::memory_order_acquire)) {
+                if (item != nullptr) {
+                    *item = copy;
+                }
+                return index;
+            }
+        }
+        return NIL;
+    }
+
+    std::atomic<uint64_t> head_{NIL};
+    std::atomic<uint64_t> free_nodes_{NIL};
+    std::atomic<uint32_t> next_unused_{0};
+    std::atomic<size_t> size_{0};
+    std::atomic<Node*> chunks_[CHUNKS_COUNT]{};
+};
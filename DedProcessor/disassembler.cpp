@@ -1,18 +1,232 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
 
 #include "commands.h"
+#include "object.h"
 #include "utils.h"
 
 
-std::string FormInstruction(Command command, const std::vector<double>& args) {
-    std::string instruction = name_by_command[command];
-    for (const auto& arg : args) {
-        instruction += " " + std::to_string(arg);
+// Text output collected in one large buffer that goes to the file whenever it fills up.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(FILE* file) : file_(file), buffer_(CAPACITY) {
     }
 
-    return instruction;
+    void Write(const char* data, size_t size) {
+        Reserve(size);
+        std::memcpy(buffer_.data() + size_, data, size);
+        size_ += size;
+    }
+
+    void Write(const std::string& text) {
+        Write(text.data(), text.size());
+    }
+
+    void Write(char symbol) {
+        Reserve(1);
+        buffer_[size_++] = symbol;
+    }
+
+    // Shortest text that std::stod reads back as exactly the same value.
+    void WriteNumber(double value) {
+        Reserve(MAX_NUMBER_LENGTH);
+        auto result = std::to_chars(buffer_.data() + size_, buffer_.data() + buffer_.size(), value);
+        size_ = result.ptr - buffer_.data();
+    }
+
+    void WriteInteger(size_t value) {
+        Reserve(MAX_NUMBER_LENGTH);
+        auto result = std::to_chars(buffer_.data() + size_, buffer_.data() + buffer_.size(), value);
+        size_ = result.ptr - buffer_.data();
+    }
+
+    bool Flush() {
+        is_ok_ &= std::fwrite(buffer_.data(), 1, size_, file_) == size_;
+        size_ = 0;
+        return is_ok_;
+    }
+
+private:
+    static constexpr size_t CAPACITY = 1 << 20;
+    static constexpr size_t MAX_NUMBER_LENGTH = 32;
+
+    void Reserve(size_t size) {
+        if (size_ + size > buffer_.size()) {
+            Flush();
+            if (size > buffer_.size()) {
+                buffer_.resize(size);
+            }
+        }
+    }
+
+    FILE* file_;
+    std::vector<char> buffer_;
+    size_t size_ = 0;
+    bool is_ok_ = true;
+};
+
+// Returns nullptr for a word that is not a command.
+const CommandInfo* FindCommandInfo(double code) {
+    if (!IsCommand(code)) {
+        return nullptr;
+    }
+    return &GetCommandInfo(static_cast<Command>(code));
+}
+
+// Symbols of a module assembled with -c, arranged for the disassembly: the module
+// imports the symbol in import_at of the code word that refers to it.
+struct ModuleSymbols {
+    std::vector<Symbol> symbols;
+    std::unordered_map<size_t, const Symbol*> import_at;
+    std::vector<const Symbol*> exports;
+};
+
+int ReadModuleSymbols(const ObjectView& object, ModuleSymbols* module) {
+    std::vector<Relocation> relocations;
+    if (ParseLinkTables(object, &module->symbols, &relocations) == -1) {
+        return -1;
+    }
+    for (const auto& relocation : relocations) {
+        if (relocation.symbol != LOCAL_SYMBOL) {
+            module->import_at[relocation.offset] = &module->symbols[relocation.symbol];
+        }
+    }
+    for (const auto& symbol : module->symbols) {
+        if (!symbol.is_import) {
+            module->exports.push_back(&symbol);
+        }
+    }
+    std::sort(module->exports.begin(), module->exports.end(), [](const Symbol* lhs, const Symbol* rhs) {
+        return lhs->offset < rhs->offset;
+    });
+    return 0;
+}
+
+// Marks every offset some jump or call goes to, these get a LABEL named after the
+// offset. Returns false if a target is not the start of an instruction, such a
+// target can not be expressed with labels.
+bool FindLabels(const ObjectView& object, const ModuleSymbols& module, std::vector<bool>* is_target) {
+    std::vector<bool> is_boundary(object.code_size + 1, false);
+    is_target->assign(object.code_size + 1, false);
+    for (size_t i = 0; i < object.code_size;) {
+        is_boundary[i] = true;
+        if (!IsCommand(object.code[i])) {
+            ++i;
+            continue;
+        }
+        auto command = static_cast<Command>(object.code[i]);
+        i += 1 + ArgsCount(command);
+        if (RequiresLabel(command) && i <= object.code_size && module.import_at.count(i - 1) == 0) {
+            auto target = static_cast<size_t>(object.code[i - 1]);
+            if (target <= object.code_size) {
+                (*is_target)[target] = true;
+            }
+        }
+    }
+    is_boundary[object.code_size] = true;
+
+    bool is_ok = true;
+    for (size_t offset = 0; offset <= object.code_size; ++offset) {
+        if ((*is_target)[offset] && !is_boundary[offset]) {
+            std::cout << "Jump target " << offset << " is not the start of an instruction\n";
+            is_ok = false;
+        }
+    }
+    return is_ok;
+}
+
+void WriteLabel(size_t offset, BufferedWriter* writer) {
+    writer->Write("LABEL ", 6);
+    writer->WriteInteger(offset);
+    writer->Write('\n');
+}
+
+void WriteDirective(std::string_view directive, const std::string& name, BufferedWriter* writer) {
+    writer->Write(directive.data(), directive.size());
+    writer->Write(' ');
+    writer->Write(name);
+    writer->Write('\n');
+}
+
+// Labels of the exported symbols at offset, exports are sorted by offset.
+void WriteExportLabels(size_t offset, const ModuleSymbols& module, size_t* next_export,
+                       BufferedWriter* writer) {
+    while (*next_export < module.exports.size() && module.exports[*next_export]->offset <= offset) {
+        WriteDirective("LABEL", module.exports[*next_export]->name, writer);
+        ++*next_export;
+    }
+}
+
+// Emits assembler source that assembles back into the same code: jump targets become
+// labels and LINE directives restore the source lines of the debug info. The imports
+// and exports of a module come first and its jumps to imported symbols keep the names.
+void Disassemble(const ObjectView& object, const ModuleSymbols& module, const std::vector<bool>& is_target,
+                 BufferedWriter* writer) {
+    for (const auto& symbol : module.symbols) {
+        WriteDirective(symbol.is_import ? "IMPORT" : "EXPORT", symbol.name, writer);
+    }
+
+    const DebugEntry* debug = object.debug;
+    const DebugEntry* debug_end = object.debug + object.debug_size;
+    uint32_t source_line = 0;
+    size_t next_export = 0;
+    for (size_t i = 0; i < object.code_size;) {
+        WriteExportLabels(i, module, &next_export, writer);
+        if (is_target[i]) {
+            WriteLabel(i, writer);
+        }
+        while (debug != debug_end && debug->offset < i) {
+            ++debug;
+        }
+        if (debug != debug_end && debug->offset == i && debug->source_line != source_line) {
+            source_line = debug->source_line;
+            writer->Write("LINE ", 5);
+            writer->WriteInteger(source_line);
+            writer->Write('\n');
+        }
+
+        const CommandInfo* info = FindCommandInfo(object.code[i]);
+        if (info == nullptr) {
+            std::cout << "Unknown command " << object.code[i] << " at offset " << i << "\n";
+            writer->WriteNumber(object.code[i]);
+            writer->Write('\n');
+            ++i;
+            continue;
+        }
+        writer->Write(info->name.data(), info->name.size());
+        ++i;
+
+        for (size_t j = 0; j < info->args_count && i < object.code_size; ++j, ++i) {
+            writer->Write(' ');
+            if (info->operands[j] == OperandKind::REGISTER) {
+                writer->Write('r');
+                writer->WriteInteger(static_cast<size_t>(object.code[i]));
+            } else if (info->operands[j] == OperandKind::LABEL) {
+                auto import = module.import_at.empty() ? module.import_at.end() : module.import_at.find(i);
+                if (import != module.import_at.end()) {
+                    writer->Write(import->second->name);
+                } else {
+                    writer->WriteInteger(static_cast<size_t>(object.code[i]));
+                }
+            } else {
+                writer->WriteNumber(object.code[i]);
+            }
+        }
+        writer->Write('\n');
+    }
+    WriteExportLabels(object.code_size, module, &next_export, writer);
+    if (is_target[object.code_size]) {
+        WriteLabel(object.code_size, writer);
+    }
 }
 
 int main(int argc, char* argv[]) {
@@ -24,29 +238,46 @@ int main(int argc, char* argv[]) {
     std::string input_name(argv[1]);
     std::string output_name("da.txt");
 
-    std::vector<double> buffer;
-    if (ReadFile(input_name, buffer) == -1) {
-        std::cout << "Invalid filename\n";
+    auto start = std::chrono::steady_clock::now();
+    MappedFile input;
+    ObjectView object;
+    ModuleSymbols module;
+    if (input.Open(input_name) == -1 || ParseObjectView(input.Data(), input.Size(), &object) == -1 ||
+        ReadModuleSymbols(object, &module) == -1) {
+        std::cout << "Invalid object file\n";
         return 0;
     }
 
-    for (const auto& it : buffer) {
-        std::cout << it << "\n";
+    FILE* output = std::fopen(output_name.data(), "w");
+    if (output == nullptr) {
+        std::cout << "Can not write " << output_name << "\n";
+        return 0;
     }
 
-    FILE* output = std::freopen(output_name.data(), "w", stdout);
-    for (size_t i = 0; i < buffer.size();) {
-        Command command = static_cast<Command>(buffer[i]);
-        ++i;
-
-        std::vector<double> args;
-        if (HasOneArg(command)) {
-            args.emplace_back(buffer[i]);
-            ++i;
-        }
+    std::vector<bool> is_target;
+    if (!FindLabels(object, module, &is_target)) {
+        std::cout << "The output will not assemble back into the same code\n";
+    }
+    BufferedWriter writer(output);
+    Disassemble(object, module, is_target, &writer);
+    bool is_written = writer.Flush();
+    is_written &= std::fclose(output) == 0;
+    if (!is_written) {
+        std::cout << "Can not write " << output_name << "\n";
+        return 0;
+    }
 
-        std::cout << FormInstruction(command, args) << "\n";
+    auto value_type = static_cast<ValueType>(object.flags & VALUE_TYPE_MASK);
+    if (value_type != ValueType::DOUBLE) {
+        std::cout << "Assemble with --value-type=" << value_type_names[static_cast<size_t>(value_type)] << "\n";
+    }
+    if (object.flags & LINKABLE) {
+        std::cout << "Assemble with -c\n";
     }
-    fclose(output);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double megabytes = static_cast<double>(input.Size()) / (1 << 20);
+    std::cout << "Disassembled " << megabytes << " MB in " << seconds << " s: "
+              << megabytes / seconds << " MB/s\n";
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <csetjmp>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "commands.h"
+
+// VM memory of size cells placed right after one PROT_NONE page and followed by
+// PROT_NONE pages up to the end of a reservation that covers every 32-bit cell index.
+// The operands of the code are checked against the memory size when the program is
+// loaded and addresses computed at runtime are clamped to GuardIndex(), so an access
+// outside the memory always lands in a guard page and faults instead of corrupting the
+// process, while the access itself needs no compare.
+template <class T>
+class GuardedMemory {
+public:
+    explicit GuardedMemory(size_t size) : size_(size) {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t usable = (size * sizeof(T) + page - 1) / page * page;
+        reservation_size_ = page + MEMORY_ADDRESSES_COUNT * sizeof(T);
+        reservation_ = mmap(nullptr, reservation_size_, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        bound_ = MEMORY_ADDRESSES_COUNT;
+        guard_index_ = MEMORY_ADDRESSES_COUNT - 1;
+        if (reservation_ == MAP_FAILED) {
+            // Without enough address space only the page after the memory guards it,
+            // and every index past the memory is sent there.
+            std::cerr << "Can not reserve guard pages for every address, "
+                         "addresses are checked against the VM memory size\n";
+            reservation_size_ = usable + 2 * page;
+            reservation_ = mmap(nullptr, reservation_size_, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            bound_ = size;
+            guard_index_ = usable / sizeof(T);
+        }
+        if (reservation_ == MAP_FAILED) {
+            std::cerr << "Can not map the VM memory\n";
+            std::exit(EXIT_FAILURE);
+        }
+        cells_ = reinterpret_cast<T*>(static_cast<char*>(reservation_) + page);
+        if (mprotect(cells_, usable, PROT_READ | PROT_WRITE) != 0) {
+            std::cerr << "Can not map the VM memory\n";
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    GuardedMemory(const GuardedMemory&) = delete;
+    GuardedMemory& operator=(const GuardedMemory&) = delete;
+
+    ~GuardedMemory() {
+        munmap(reservation_, reservation_size_);
+    }
+
+    // index is below AddressesCount(), or GuardIndex() for an address that is not.
+    T& operator[](size_t index) {
+        return cells_[index];
+    }
+
+    const T& operator[](size_t index) const {
+        return cells_[index];
+    }
+
+    // Number of indices operator[] takes: every 32-bit one, or only the cells of the
+    // memory when the reservation is the small one.
+    size_t AddressesCount() const {
+        return bound_;
+    }
+
+    // Index of a cell in a guard page.
+    size_t GuardIndex() const {
+        return guard_index_;
+    }
+
+    void Clear() {
+        std::memset(static_cast<void*>(cells_), 0, size_ * sizeof(T));
+    }
+
+    bool Contains(const void* address) const {
+        const char* begin = static_cast<const char*>(reservation_);
+        return address >= begin && address < begin + reservation_size_;
+    }
+
+private:
+    size_t size_;
+    size_t bound_;
+    size_t guard_index_;
+    void* reservation_;
+    size_t reservation_size_;
+    T* cells_;
+};
+
+// Guard of the run in progress on this thread, read by the SIGSEGV handler.
+struct ActiveMemoryGuard {
+    const void* memory = nullptr;
+    bool (*contains)(const void* memory, const void* address) = nullptr;
+    sigjmp_buf* jump = nullptr;
+};
+
+thread_local ActiveMemoryGuard active_memory_guard;
+
+void HandleGuardFault(int signal, siginfo_t* info, void* context) {
+    const ActiveMemoryGuard& guard = active_memory_guard;
+    if (guard.jump != nullptr && guard.contains(guard.memory, info->si_addr)) {
+        siglongjmp(*guard.jump, 1);
+    }
+    // Not a VM memory access: returning with the default action re-raises the fault.
+    std::signal(SIGSEGV, SIG_DFL);
+}
+
+void InstallGuardFaultHandler() {
+    static const bool is_installed = [] {
+        struct sigaction action {};
+        action.sa_sigaction = HandleGuardFault;
+        action.sa_flags = SA_SIGINFO;
+        sigemptyset(&action.sa_mask);
+        return sigaction(SIGSEGV, &action, nullptr) == 0;
+    }();
+    (void)is_installed;
+}
+
+// Calls function and returns false if it touched a guard page of memory; the
+// function is abandoned at the faulting access with siglongjmp, which runs no
+// destructors, so it must not own heap memory at any access to memory.
+template <class T, class Function>
+bool RunWithMemoryGuard(const GuardedMemory<T>& memory, Function function) {
+    InstallGuardFaultHandler();
+
+    sigjmp_buf jump;
+    ActiveMemoryGuard previous = active_memory_guard;
+    if (sigsetjmp(jump, 1) != 0) {
+        active_memory_guard = previous;
+        return false;
+    }
+
+    active_memory_guard.memory = &memory;
+    active_memory_guard.contains = [](const void* guarded, const void* address) {
+        return static_cast<const GuardedMemory<T>*>(guarded)->Contains(address);
+    };
+    active_memory_guard.jump = &jump;
+    function();
+    active_memory_guard = previous;
+    return true;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+// VM memory is one flat array of cells: the first STATIC_MEMORY_SIZE cells are the
+// ones programs address directly, the rest belongs to the heap.
+constexpr size_t STATIC_MEMORY_SIZE = 4096;
+constexpr size_t MEMORY_SIZE = 1 << 16;
+
+// Allocator for the heap part of VM memory. Blocks requested with ALLOC are rounded
+// up to a power of two and recycled through one free list per size class; they are
+// carved from the bottom of the heap. Scratch blocks requested with ARENA_ALLOC are
+// bumped down from the top of the heap and are all released at once by ARENA_RESET.
+// Address 0 is never a heap address and is returned when the heap is exhausted.
+class Heap {
+public:
+    struct Stats {
+        size_t allocations = 0;
+        size_t frees = 0;
+        size_t invalid_frees = 0;
+        size_t reused_blocks = 0;
+        size_t arena_allocations = 0;
+        size_t arena_resets = 0;
+        size_t failed_allocations = 0;
+        size_t peak_pool_cells = 0;
+        size_t peak_arena_cells = 0;
+    };
+
+    Heap(size_t begin, size_t end)
+        : begin_(begin), end_(end), pool_top_(begin), arena_top_(end),
+          block_class_(end - begin, 0) {
+    }
+
+    size_t Allocate(size_t size) {
+        if (size > end_ - begin_) {
+            ++stats_.failed_allocations;
+            return 0;
+        }
+
+        size_t size_class = SizeClass(size);
+        if (size_class >= free_blocks_.size()) {
+            free_blocks_.resize(size_class + 1);
+        }
+
+        size_t address = 0;
+        if (!free_blocks_[size_class].empty()) {
+            address = free_blocks_[size_class].back();
+            free_blocks_[size_class].pop_back();
+            ++stats_.reused_blocks;
+        } else {
+            size_t block_size = static_cast<size_t>(1) << size_class;
+            if (arena_top_ - pool_top_ < block_size) {
+                ++stats_.failed_allocations;
+                return 0;
+            }
+            address = pool_top_;
+            pool_top_ += block_size;
+            if (pool_top_ - begin_ > stats_.peak_pool_cells) {
+                stats_.peak_pool_cells = pool_top_ - begin_;
+            }
+        }
+
+        block_class_[address - begin_] = static_cast<unsigned char>(size_class + 1);
+        ++stats_.allocations;
+        return address;
+    }
+
+    void Free(size_t address) {
+        if (address < begin_ || address >= pool_top_ || block_class_[address - begin_] == 0) {
+            ++stats_.invalid_frees;
+            return;
+        }
+
+        size_t size_class = block_class_[address - begin_] - 1;
+        block_class_[address - begin_] = 0;
+        free_blocks_[size_class].emplace_back(address);
+        ++stats_.frees;
+    }
+
+    size_t ArenaAllocate(size_t size) {
+        if (size == 0) {
+            size = 1;
+        }
+        if (arena_top_ - pool_top_ < size) {
+            ++stats_.failed_allocations;
+            return 0;
+        }
+
+        arena_top_ -= size;
+        if (end_ - arena_top_ > stats_.peak_arena_cells) {
+            stats_.peak_arena_cells = end_ - arena_top_;
+        }
+        ++stats_.arena_allocations;
+        return arena_top_;
+    }
+
+    void ArenaReset() {
+        arena_top_ = end_;
+        ++stats_.arena_resets;
+    }
+
+    const Stats& GetStats() const {
+        return stats_;
+    }
+
+    void PrintStats(std::ostream* out) const {
+        *out << "Heap allocations:       " << stats_.allocations << "\n"
+             << "Heap frees:             " << stats_.frees << "\n"
+             << "Reused pool blocks:     " << stats_.reused_blocks << "\n"
+             << "Invalid frees:          " << stats_.invalid_frees << "\n"
+             << "Arena allocations:      " << stats_.arena_allocations << "\n"
+             << "Arena resets:           " << stats_.arena_resets << "\n"
+             << "Failed allocations:     " << stats_.failed_allocations << "\n"
+             << "Peak pool cells:        " << stats_.peak_pool_cells << "\n"
+             << "Peak arena cells:       " << stats_.peak_arena_cells << "\n";
+    }
+
+private:
+    static size_t SizeClass(size_t size) {
+        size_t size_class = 0;
+        while ((static_cast<size_t>(1) << size_class) < size) {
+            ++size_class;
+        }
+        return size_class;
+    }
+
+    size_t begin_;
+    size_t end_;
+    size_t pool_top_;
+    size_t arena_top_;
+    std::vector<unsigned char> block_class_;
+    std::vector<std::vector<size_t>> free_blocks_;
+    Stats stats_;
+};
@@ -0,0 +1,131 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+#include "object.h"
+
+
+struct Module {
+    std::string name;
+    ObjectFile object{};
+    size_t base = 0;
+};
+
+// Places the modules one after another in the order given, the program starts with
+// the code of the first one, and collects the addresses of all exported symbols.
+int PlaceModules(std::vector<Module>& modules, std::unordered_map<std::string, size_t>* addresses) {
+    std::unordered_map<std::string, const Module*> exporters;
+    size_t base = 0;
+    for (auto& module : modules) {
+        if (GetValueType(module.object) != GetValueType(modules[0].object)) {
+            std::cout << module.name << " computes with "
+                      << value_type_names[static_cast<size_t>(GetValueType(module.object))] << ", "
+                      << modules[0].name << " with "
+                      << value_type_names[static_cast<size_t>(GetValueType(modules[0].object))] << "\n";
+            return -1;
+        }
+
+        module.base = base;
+        base += module.object.code.size();
+        for (const auto& symbol : module.object.symbols) {
+            if (symbol.is_import) {
+                continue;
+            }
+            auto [found, is_new] = exporters.emplace(symbol.name, &module);
+            if (!is_new) {
+                std::cout << "Symbol " << symbol.name << " is exported by both " << found->second->name
+                          << " and " << module.name << "\n";
+                return -1;
+            }
+            (*addresses)[symbol.name] = module.base + symbol.offset;
+        }
+    }
+    return 0;
+}
+
+// Appends the module to program with every jump target moved to the module's place.
+int LinkModule(const Module& module, const std::unordered_map<std::string, size_t>& addresses,
+               ObjectFile* program) {
+    const ObjectFile& object = module.object;
+    if (!(object.flags & LINKABLE)) {
+        std::cout << module.name << " has no link tables, assemble it with -c\n";
+        return -1;
+    }
+
+    program->code.insert(program->code.end(), object.code.begin(), object.code.end());
+    for (auto entry : object.debug) {
+        entry.offset += module.base;
+        program->debug.push_back(entry);
+    }
+
+    for (const auto& relocation : object.relocations) {
+        double& target = program->code[module.base + relocation.offset];
+        if (relocation.symbol == LOCAL_SYMBOL) {
+            target += static_cast<double>(module.base);
+            continue;
+        }
+        const std::string& name = object.symbols[relocation.symbol].name;
+        auto found = addresses.find(name);
+        if (found == addresses.end()) {
+            std::cout << "Undefined symbol " << name << " imported by " << module.name << "\n";
+            return -1;
+        }
+        target = static_cast<double>(found->second);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    std::vector<Module> modules;
+    std::string output_name("a.o");
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "-o" && i + 1 < argc) {
+            output_name = argv[++i];
+        } else {
+            modules.push_back({arg});
+        }
+    }
+
+    if (modules.empty()) {
+        std::cout << "Invalid count of arguments.\n Enter names of objects assembled with -c, "
+                     "the program starts in the first one [-o output]\n";
+        return 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto& module : modules) {
+        if (ReadObject(module.name, &module.object) == -1) {
+            std::cout << "Invalid object file " << module.name << "\n";
+            return 0;
+        }
+    }
+
+    std::unordered_map<std::string, size_t> addresses;
+    if (PlaceModules(modules, &addresses) == -1) {
+        std::cout << "Linking terminated\n";
+        return 0;
+    }
+
+    // The linked program has no link tables left, so it can not be linked again.
+    ObjectFile program;
+    program.flags = modules[0].object.flags & VALUE_TYPE_MASK;
+    for (const auto& module : modules) {
+        if (LinkModule(module, addresses, &program) == -1) {
+            std::cout << "Linking terminated\n";
+            return 0;
+        }
+    }
+
+    if (WriteObject(output_name, program) == -1) {
+        std::cout << "Can not write " << output_name << "\n";
+        return 0;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Linked " << modules.size() << " objects into " << program.code.size() << " words in "
+              << seconds << " s\n";
+    return 0;
+}
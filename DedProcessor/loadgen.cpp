@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+#include "utils.h"
+
+bool RunOnce(int fd, const std::string& request, std::string* output, uint8_t* status) {
+    if (!WriteAll(fd, request.data(), request.size())) {
+        return false;
+    }
+
+    if (!ReadValue(fd, status)) {
+        return false;
+    }
+    output->clear();
+    uint32_t size = 0;
+    while (ReadValue(fd, &size) && size > 0) {
+        size_t begin = output->size();
+        output->resize(begin + size);
+        if (!ReadAll(fd, &(*output)[begin], size)) {
+            return false;
+        }
+    }
+    return *status == REPLY_OK;
+}
+
+double Percentile(const std::vector<double>& sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1));
+    return sorted[index];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 4 && argc != 5) {
+        std::cout << "Invalid count of arguments.\n"
+                     " Enter socket path, object file, input file [count of requests]\n";
+        return 0;
+    }
+
+    std::string socket_path(argv[1]);
+    size_t requests = argc == 5 ? std::stoul(argv[4]) : 10000;
+    if (requests == 0) {
+        std::cout << "Count of requests must be positive\n";
+        return 0;
+    }
+
+    std::vector<char> program;
+    std::string input;
+    if (ReadFile(argv[2], program) == -1 || ReadFile(argv[3], input) == -1) {
+        std::cout << "Invalid filename\n";
+        return 0;
+    }
+    if (program.size() > MAX_PROGRAM_SIZE || input.size() > MAX_INPUT_SIZE) {
+        std::cout << "Can not send to the server: "
+                  << ReplyStatusMessage(program.size() > MAX_PROGRAM_SIZE ? PROGRAM_TOO_LARGE : INPUT_TOO_LARGE)
+                  << "\n";
+        return 0;
+    }
+    // A server that refuses a request closes the connection, which must not kill us
+    // before its reply is read.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (!FillSocketAddress(socket_path, &address) || fd == -1 ||
+        connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+        std::cout << "Can not connect to " << socket_path << "\n";
+        return 0;
+    }
+
+    uint8_t status = 0;
+    uint64_t hash = 0;
+    if (!WriteValue(fd, PUT_PROGRAM) || !WriteValue<uint64_t>(fd, program.size()) ||
+        !WriteAll(fd, program.data(), program.size()) || !ReadValue(fd, &status)) {
+        std::cout << "Can not upload program\n";
+        return 0;
+    }
+    if (status != REPLY_OK) {
+        std::cout << "Can not upload program: " << ReplyStatusMessage(status) << "\n";
+        return 0;
+    }
+    if (!ReadValue(fd, &hash)) {
+        std::cout << "Can not upload program\n";
+        return 0;
+    }
+
+    // The whole request goes out in one write so that a run costs one round trip.
+    std::string request(1, static_cast<char>(RUN));
+    uint64_t input_size = input.size();
+    request.append(reinterpret_cast<const char*>(&hash), sizeof(hash));
+    request.append(reinterpret_cast<const char*>(&input_size), sizeof(input_size));
+    request += input;
+
+    std::string output;
+    std::vector<double> latencies;
+    latencies.reserve(requests);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < requests; ++i) {
+        auto begin = std::chrono::steady_clock::now();
+        if (!RunOnce(fd, request, &output, &status)) {
+            std::cout << "Request failed";
+            if (status != REPLY_OK) {
+                std::cout << ": " << ReplyStatusMessage(status);
+            }
+            std::cout << "\n";
+            return 0;
+        }
+        auto end = std::chrono::steady_clock::now();
+        latencies.emplace_back(std::chrono::duration<double, std::micro>(end - begin).count());
+    }
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    close(fd);
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << "Output of the last run:\n" << output;
+    std::cout << "Requests: " << requests << "\n"
+              << "Throughput: " << requests / total << " req/s\n"
+              << "p50: " << Percentile(latencies, 0.5) << " us\n"
+              << "p99: " << Percentile(latencies, 0.99) << " us\n"
+              << "max: " << latencies.back() << " us\n";
+    return 0;
+}
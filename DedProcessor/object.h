@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+// Object file layout: ObjectHeader, then code_size doubles of code, then debug_size
+// DebugEntry records sorted by offset, then the link tables if the LINKABLE flag is
+// set. Files that do not start with the magic are plain code, as written by
+// assemblers that predate the header.
+struct ObjectHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t code_size;
+    uint64_t debug_size;
+};
+
+const char OBJECT_MAGIC[4] = {'D', 'E', 'D', 'O'};
+const uint32_t OBJECT_VERSION = 1;
+
+// The low bits of the header flags select the type of the values the program
+// computes with: the processor is instantiated for it when the program is loaded.
+enum class ValueType : uint32_t {
+    DOUBLE,
+    FLOAT32,
+    INT64,
+    LONG_DOUBLE,
+    COUNT
+};
+
+const uint32_t VALUE_TYPE_MASK = 0xF;
+
+// Set for modules assembled to be linked by dedld, these carry the link tables.
+const uint32_t LINKABLE = 0x10;
+const char* value_type_names[static_cast<size_t>(ValueType::COUNT)] = {
+        "double",
+        "float32",
+        "int64",
+        "long-double"
+};
+
+// Maps the instruction at a code offset to the line of the .asm file it was
+// assembled from and, when the program was compiled by DedCompiler, to the line of the
+// source program. Line 0 means the line is unknown.
+struct DebugEntry {
+    uint64_t offset;
+    uint32_t asm_line;
+    uint32_t source_line;
+};
+
+// Named label of a separately assembled module: either exported by it and defined at
+// offset of its code, or imported from another module.
+struct Symbol {
+    std::string name;
+    uint64_t offset = 0;
+    bool is_import = false;
+};
+
+// Code word at offset holds a jump target that moves when modules are linked: an
+// offset into the module's own code for LOCAL_SYMBOL, otherwise the imported symbol
+// with that index, whose word stays 0 until it is linked.
+struct Relocation {
+    uint64_t offset;
+    uint64_t symbol;
+};
+
+const uint64_t LOCAL_SYMBOL = UINT64_MAX;
+
+struct ObjectFile {
+    uint32_t flags = 0;
+    std::vector<double> code;
+    std::vector<DebugEntry> debug;
+    std::vector<Symbol> symbols;
+    std::vector<Relocation> relocations;
+};
+
+ValueType GetValueType(const ObjectFile& object) {
+    return static_cast<ValueType>(object.flags & VALUE_TYPE_MASK);
+}
+
+void SetValueType(ObjectFile* object, ValueType type) {
+    object->flags = (object->flags & ~VALUE_TYPE_MASK) | static_cast<uint32_t>(type);
+}
+
+// Returns false if name is not one of value_type_names.
+bool ParseValueType(const std::string& name, ValueType* type) {
+    for (size_t i = 0; i < static_cast<size_t>(ValueType::COUNT); ++i) {
+        if (name == value_type_names[i]) {
+            *type = static_cast<ValueType>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Calls function with a zero of the C++ type that implements type, so that a generic
+// lambda can instantiate the processor for it.
+template <class Function>
+void WithValueType(ValueType type, Function function) {
+    switch (type) {
+        case ValueType::FLOAT32:
+            function(float());
+            break;
+        case ValueType::INT64:
+            function(int64_t());
+            break;
+        case ValueType::LONG_DOUBLE:
+            function(static_cast<long double>(0));
+            break;
+        default:
+            function(double());
+            break;
+    }
+}
+
+// Object file parsed in place: code and debug point into the bytes it was parsed
+// from, which have to stay alive and 8-byte aligned. The link tables are left
+// unparsed, see ParseLinkTables.
+struct ObjectView {
+    uint32_t flags = 0;
+    const double* code = nullptr;
+    size_t code_size = 0;
+    const DebugEntry* debug = nullptr;
+    size_t debug_size = 0;
+    const char* link_tables = nullptr;
+    size_t link_tables_size = 0;
+};
+
+int ParseObjectView(const char* data, size_t size, ObjectView* view) {
+    *view = ObjectView();
+
+    ObjectHeader header;
+    if (size < sizeof(header) || std::memcmp(data, OBJECT_MAGIC, sizeof(OBJECT_MAGIC)) != 0) {
+        view->code = reinterpret_cast<const double*>(data);
+        view->code_size = size / sizeof(double);
+        return 0;
+    }
+
+    std::memcpy(&header, data, sizeof(header));
+    // The sizes come from the file, so they are compared by division before the byte
+    // counts are computed, which then can not overflow.
+    size_t rest = size - sizeof(header);
+    if (header.version != OBJECT_VERSION || header.code_size > rest / sizeof(double) ||
+        (header.flags & VALUE_TYPE_MASK) >= static_cast<uint32_t>(ValueType::COUNT)) {
+        return -1;
+    }
+    size_t code_bytes = header.code_size * sizeof(double);
+    if (header.debug_size > (rest - code_bytes) / sizeof(DebugEntry)) {
+        return -1;
+    }
+    size_t debug_bytes = header.debug_size * sizeof(DebugEntry);
+
+    view->flags = header.flags;
+    view->code = reinterpret_cast<const double*>(data + sizeof(header));
+    view->code_size = header.code_size;
+    view->debug = reinterpret_cast<const DebugEntry*>(data + sizeof(header) + code_bytes);
+    view->debug_size = header.debug_size;
+    if (header.flags & LINKABLE) {
+        view->link_tables = data + sizeof(header) + code_bytes + debug_bytes;
+        view->link_tables_size = size - (sizeof(header) + code_bytes + debug_bytes);
+    }
+    return 0;
+}
+
+// Link tables layout: the number of relocations and of symbols as two uint64_t, the
+// Relocation records, then every symbol as its offset (uint64_t), is_import and the
+// name length (uint32_t each) followed by the name.
+int ParseLinkTables(const ObjectView& view, std::vector<Symbol>* symbols,
+                    std::vector<Relocation>* relocations) {
+    symbols->clear();
+    relocations->clear();
+    if (view.link_tables == nullptr) {
+        return 0;
+    }
+    const char* data = view.link_tables;
+    const char* end = view.link_tables + view.link_tables_size;
+    auto read = [&data, end](void* value, size_t size) {
+        if (static_cast<size_t>(end - data) < size) {
+            return false;
+        }
+        std::memcpy(value, data, size);
+        data += size;
+        return true;
+    };
+
+    uint64_t relocations_size = 0;
+    uint64_t symbols_size = 0;
+    if (!read(&relocations_size, sizeof(relocations_size)) || !read(&symbols_size, sizeof(symbols_size)) ||
+        relocations_size > view.link_tables_size / sizeof(Relocation)) {
+        return -1;
+    }
+    relocations->resize(relocations_size);
+    if (!read(relocations->data(), relocations_size * sizeof(Relocation))) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < symbols_size; ++i) {
+        Symbol symbol;
+        uint32_t is_import = 0;
+        uint32_t name_size = 0;
+        if (!read(&symbol.offset, sizeof(symbol.offset)) || !read(&is_import, sizeof(is_import)) ||
+            !read(&name_size, sizeof(name_size)) || static_cast<size_t>(end - data) < name_size) {
+            return -1;
+        }
+        symbol.is_import = is_import != 0;
+        symbol.name.assign(data, name_size);
+        data += name_size;
+        symbols->push_back(std::move(symbol));
+    }
+
+    for (const auto& relocation : *relocations) {
+        if (relocation.offset >= view.code_size ||
+            (relocation.symbol != LOCAL_SYMBOL && relocation.symbol >= symbols->size())) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int ParseObject(const char* data, size_t size, ObjectFile* object) {
+    object->flags = 0;
+    object->code.clear();
+    object->debug.clear();
+    object->symbols.clear();
+    object->relocations.clear();
+
+    // The bytes may come from a buffer with no alignment guarantee, so the view is
+    // only used as a source for memcpy here.
+    ObjectView view;
+    if (ParseObjectView(data, size, &view) == -1) {
+        return -1;
+    }
+    object->flags = view.flags;
+    object->code.resize(view.code_size);
+    std::memcpy(object->code.data(), view.code, view.code_size * sizeof(double));
+    object->debug.resize(view.debug_size);
+    std::memcpy(object->debug.data(), view.debug, view.debug_size * sizeof(DebugEntry));
+    return ParseLinkTables(view, &object->symbols, &object->relocations);
+}
+
+int ReadObject(const std::string& filename, ObjectFile* object) {
+    std::vector<char> bytes;
+    if (ReadFile(filename, bytes) == -1) {
+        return -1;
+    }
+    return ParseObject(bytes.data(), bytes.size(), object);
+}
+
+void WriteLinkTables(const ObjectFile& object, FILE* output) {
+    uint64_t relocations_size = object.relocations.size();
+    uint64_t symbols_size = object.symbols.size();
+    std::fwrite(&relocations_size, sizeof(relocations_size), 1, output);
+    std::fwrite(&symbols_size, sizeof(symbols_size), 1, output);
+    std::fwrite(object.relocations.data(), sizeof(object.relocations[0]), object.relocations.size(), output);
+    for (const auto& symbol : object.symbols) {
+        uint32_t is_import = symbol.is_import;
+        uint32_t name_size = symbol.name.size();
+        std::fwrite(&symbol.offset, sizeof(symbol.offset), 1, output);
+        std::fwrite(&is_import, sizeof(is_import), 1, output);
+        std::fwrite(&name_size, sizeof(name_size), 1, output);
+        std::fwrite(symbol.name.data(), 1, symbol.name.size(), output);
+    }
+}
+
+int WriteObject(const std::string& filename, const ObjectFile& object) {
+    ObjectHeader header{};
+    std::memcpy(header.magic, OBJECT_MAGIC, sizeof(OBJECT_MAGIC));
+    header.version = OBJECT_VERSION;
+    header.flags = object.flags;
+    header.code_size = object.code.size();
+    header.debug_size = object.debug.size();
+
+    FILE* output = std::fopen(filename.data(), "w");
+    if (output == nullptr) {
+        return -1;
+    }
+    std::fwrite(&header, sizeof(header), 1, output);
+    std::fwrite(object.code.data(), sizeof(object.code[0]), object.code.size(), output);
+    std::fwrite(object.debug.data(), sizeof(object.debug[0]), object.debug.size(), output);
+    if (object.flags & LINKABLE) {
+        WriteLinkTables(object, output);
+    }
+    return std::fclose(output);
+}
+
+// Returns the first symbol the object imports or nullptr; such an object can not run
+// before it is linked.
+const Symbol* FindImport(const ObjectFile& object) {
+    for (const auto& symbol : object.symbols) {
+        if (symbol.is_import) {
+            return &symbol;
+        }
+    }
+    return nullptr;
+}
+
+// Returns the debug entry of the instruction covering offset or nullptr.
+const DebugEntry* FindDebugEntry(const std::vector<DebugEntry>& debug, size_t offset) {
+    auto found = std::upper_bound(debug.begin(), debug.end(), offset,
+                                  [](size_t value, const DebugEntry& entry) {
+                                      return value < entry.offset;
+                                  });
+    if (found == debug.begin()) {
+        return nullptr;
+    }
+    return &*(found - 1);
+}
@@ -0,0 +1,577 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "block_profile.h"
+#include "bytecode.h"
+#include "commands.h"
+#include "utils.h"
+
+// While the program is being optimized, the target operand of every jump and call
+// holds the index of the target instruction rather than its offset; program.size()
+// stands for the end of the program.
+
+bool ConvertTargetsToIndices(std::vector<Instruction>& program) {
+    std::vector<double> targets(program.size());
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (!IsJump(program[i].command)) {
+            continue;
+        }
+        long long target = FindInstructionByOffset(program, JumpTarget(program[i]));
+        if (target == -1) {
+            std::cout << "Invalid jump target at offset " << program[i].offset << "\n";
+            return false;
+        }
+        targets[i] = static_cast<double>(target);
+    }
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (IsJump(program[i].command)) {
+            program[i].args.back() = targets[i];
+        }
+    }
+    return true;
+}
+
+void Relocate(const std::vector<Instruction>& program, ObjectFile* object) {
+    std::vector<size_t> offset(program.size() + 1);
+    for (size_t i = 0; i < program.size(); ++i) {
+        offset[i + 1] = offset[i] + 1 + program[i].args.size();
+    }
+
+    object->code.clear();
+    object->debug.clear();
+    object->code.reserve(offset.back());
+    for (const auto& instruction : program) {
+        if (instruction.asm_line != 0 || instruction.source_line != 0) {
+            object->debug.push_back({object->code.size(), instruction.asm_line, instruction.source_line});
+        }
+        object->code.emplace_back(instruction.command);
+        object->code.insert(object->code.end(), instruction.args.begin(), instruction.args.end());
+        if (IsJump(instruction.command)) {
+            object->code.back() = static_cast<double>(offset[JumpTarget(instruction)]);
+        }
+    }
+}
+
+// Drops the instructions that are not kept. A jump to a dropped instruction continues
+// at the first kept instruction after it, which is what execution of the dropped
+// instruction would have led to.
+void Compact(std::vector<Instruction>& program, const std::vector<bool>& keep) {
+    std::vector<size_t> new_index(program.size() + 1);
+    size_t kept = 0;
+    for (size_t i = 0; i < program.size(); ++i) {
+        new_index[i] = kept;
+        if (keep[i]) {
+            ++kept;
+        }
+    }
+    new_index[program.size()] = kept;
+
+    std::vector<Instruction> result;
+    result.reserve(kept);
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (!keep[i]) {
+            continue;
+        }
+        result.emplace_back(program[i]);
+        if (IsJump(result.back().command)) {
+            result.back().args.back() = static_cast<double>(new_index[JumpTarget(program[i])]);
+        }
+    }
+    program.swap(result);
+}
+
+std::vector<bool> FindJumpTargets(const std::vector<Instruction>& program) {
+    std::vector<bool> is_target(program.size() + 1, false);
+    for (const auto& instruction : program) {
+        if (IsJump(instruction.command)) {
+            is_target[JumpTarget(instruction)] = true;
+        }
+    }
+    return is_target;
+}
+
+bool ThreadJumps(std::vector<Instruction>& program) {
+    bool changed = false;
+    for (auto& instruction : program) {
+        if (!IsJump(instruction.command)) {
+            continue;
+        }
+
+        size_t target = JumpTarget(instruction);
+        for (size_t steps = 0; steps < program.size() && target < program.size() &&
+                               program[target].command == JUMP; ++steps) {
+            target = JumpTarget(program[target]);
+        }
+        if (target != JumpTarget(instruction)) {
+            instruction.args.back() = static_cast<double>(target);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool RemoveJumpsToNext(std::vector<Instruction>& program) {
+    std::vector<bool> keep(program.size(), true);
+    bool changed = false;
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (program[i].command == JUMP && JumpTarget(program[i]) == i + 1) {
+            keep[i] = false;
+            changed = true;
+        }
+    }
+    if (changed) {
+        Compact(program, keep);
+    }
+    return changed;
+}
+
+std::vector<bool> FindBlockLeaders(const std::vector<Instruction>& program) {
+    auto is_leader = FindJumpTargets(program);
+    is_leader[0] = true;
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (EndsBlock(program[i].command)) {
+            is_leader[i + 1] = true;
+        }
+    }
+    return is_leader;
+}
+
+// Builds the control flow graph over basic blocks and removes every block that is
+// not reachable from the entry point.
+bool RemoveUnreachableCode(std::vector<Instruction>& program) {
+    if (program.empty()) {
+        return false;
+    }
+
+    auto is_leader = FindBlockLeaders(program);
+    std::vector<size_t> block_end(program.size());
+    for (size_t begin = 0; begin < program.size();) {
+        size_t end = begin + 1;
+        while (end < program.size() && !is_leader[end]) {
+            ++end;
+        }
+        block_end[begin] = end;
+        begin = end;
+    }
+
+    std::vector<bool> reachable(program.size() + 1, false);
+    std::vector<size_t> queue = {0};
+    reachable[0] = true;
+    while (!queue.empty()) {
+        size_t begin = queue.back();
+        queue.pop_back();
+        if (begin == program.size()) {
+            continue;
+        }
+
+        const Instruction& last = program[block_end[begin] - 1];
+        std::vector<size_t> successors;
+        if (IsJump(last.command)) {
+            successors.emplace_back(JumpTarget(last));
+        }
+        if (last.command != JUMP && last.command != RET && last.command != END) {
+            successors.emplace_back(block_end[begin]);
+        }
+        for (size_t successor : successors) {
+            if (!reachable[successor]) {
+                reachable[successor] = true;
+                queue.emplace_back(successor);
+            }
+        }
+    }
+
+    std::vector<bool> keep(program.size(), false);
+    bool changed = false;
+    for (size_t begin = 0; begin < program.size(); begin = block_end[begin]) {
+        for (size_t i = begin; i < block_end[begin]; ++i) {
+            keep[i] = reachable[begin];
+        }
+        changed |= !reachable[begin];
+    }
+    if (changed) {
+        Compact(program, keep);
+    }
+    return changed;
+}
+
+// Folded values become PUSH operands, which are doubles: a result that a double can
+// not hold exactly is left to be computed at run time.
+template <class Value>
+bool StoreFolded(Value value, double& result) {
+    result = static_cast<double>(value);
+    return static_cast<Value>(result) == value;
+}
+
+template <class Value>
+bool FoldBinaryOperation(Command command, Value lhs, Value rhs, double& result) {
+    switch (command) {
+        case ADD:
+            return StoreFolded<Value>(lhs + rhs, result);
+        case SUB:
+            return StoreFolded<Value>(lhs - rhs, result);
+        case MUL:
+            return StoreFolded<Value>(lhs * rhs, result);
+        case DIV:
+            if (std::is_integral<Value>::value && rhs == 0) {
+                return false;
+            }
+            return StoreFolded<Value>(lhs / rhs, result);
+        default:
+            return false;
+    }
+}
+
+template <class Value>
+bool FoldCondition(Command command, Value lhs, Value rhs, bool& result) {
+    switch (command) {
+        case JE:
+            result = lhs == rhs;
+            return true;
+        case JN:
+            result = lhs != rhs;
+            return true;
+        case JL:
+            result = lhs < rhs;
+            return true;
+        case JG:
+            result = lhs > rhs;
+            return true;
+        case JGE:
+            result = !(lhs < rhs);
+            return true;
+        case JLE:
+            result = !(lhs > rhs);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Constant folding and peephole rewrites inside basic blocks: an instruction that
+// is a jump target is never merged with the instructions before it. Arithmetic is
+// done in Value, the type the processor will compute the program with.
+template <class Value>
+bool FoldConstants(std::vector<Instruction>& program) {
+    auto is_target = FindJumpTargets(program);
+    std::vector<bool> keep(program.size(), true);
+    bool changed = false;
+
+    auto is_push = [&](size_t i) {
+        return i < program.size() && keep[i] && program[i].command == PUSH;
+    };
+
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (!keep[i]) {
+            continue;
+        }
+
+        if (is_push(i) && i + 1 < program.size() && !is_target[i + 1]) {
+            Command next = program[i + 1].command;
+            double root = 0;
+            if (next == SQRT &&
+                StoreFolded(static_cast<Value>(std::sqrt(static_cast<Value>(program[i].args[0]))), root)) {
+                program[i].args[0] = root;
+                keep[i + 1] = false;
+                changed = true;
+                continue;
+            }
+            if (next == POP) {
+                keep[i] = keep[i + 1] = false;
+                changed = true;
+                continue;
+            }
+        }
+
+        if (is_push(i) && is_push(i + 1) && i + 2 < program.size() &&
+            !is_target[i + 1] && !is_target[i + 2]) {
+            auto lhs = static_cast<Value>(program[i].args[0]);
+            auto rhs = static_cast<Value>(program[i + 1].args[0]);
+            double value = 0;
+            bool condition = false;
+            if (FoldBinaryOperation(program[i + 2].command, lhs, rhs, value)) {
+                program[i + 2].command = PUSH;
+                program[i + 2].args = {value};
+                keep[i] = keep[i + 1] = false;
+                changed = true;
+            } else if (FoldCondition(program[i + 2].command, lhs, rhs, condition)) {
+                if (condition) {
+                    program[i + 2].command = JUMP;
+                } else {
+                    keep[i + 2] = false;
+                }
+                keep[i] = keep[i + 1] = false;
+                changed = true;
+            }
+        }
+    }
+    if (changed) {
+        Compact(program, keep);
+    }
+    return changed;
+}
+
+// MOV_STOMEM x; MOV_MEMTOS x stores the top of the stack and immediately reloads
+// it: keep the value on the stack with DUP instead of reading memory back. The same
+// goes for STORE_LOCAL i; LOAD_LOCAL i.
+// MOV_MEMTOS x; MOV_STOMEM x writes back what was just read and is dropped.
+bool ForwardStores(std::vector<Instruction>& program) {
+    auto is_target = FindJumpTargets(program);
+    std::vector<bool> keep(program.size(), true);
+    bool changed = false;
+
+    for (size_t i = 0; i + 1 < program.size(); ++i) {
+        if (!keep[i] || is_target[i + 1]) {
+            continue;
+        }
+        Instruction& first = program[i];
+        Instruction& second = program[i + 1];
+        bool same_cell = !first.args.empty() && !second.args.empty() &&
+                         first.args[0] == second.args[0];
+
+        bool is_store_reload = (first.command == MOV_STOMEM && second.command == MOV_MEMTOS) ||
+                               (first.command == STORE_LOCAL && second.command == LOAD_LOCAL);
+        if (is_store_reload && same_cell) {
+            second = first;
+            first.command = DUP;
+            first.args.clear();
+            changed = true;
+        } else if (first.command == MOV_MEMTOS && second.command == MOV_STOMEM && same_cell) {
+            keep[i] = keep[i + 1] = false;
+            changed = true;
+        } else if (first.command == DUP && second.command == POP) {
+            keep[i] = keep[i + 1] = false;
+            changed = true;
+        }
+    }
+    if (changed) {
+        Compact(program, keep);
+    }
+    return changed;
+}
+
+struct LayoutEdge {
+    uint64_t weight;
+    size_t from;
+    size_t to;
+};
+
+// Profile-guided block layout. Blocks are greedily chained along their hottest
+// edges so that hot paths fall through, conditional jumps are inverted when their
+// target ends up next and blocks that never executed are moved to the end. The
+// block after a CALL is where the call returns to, so it always stays right after it.
+// Returns the number of taken jumps the profiled run would make before and after.
+std::pair<uint64_t, uint64_t> ReorderBlocks(std::vector<Instruction>& program,
+                                            const std::vector<uint64_t>& executed,
+                                            const std::vector<uint64_t>& taken) {
+    const size_t none = std::numeric_limits<size_t>::max();
+    const uint64_t forced = std::numeric_limits<uint64_t>::max();
+
+    auto is_leader = FindBlockLeaders(program);
+    std::vector<size_t> begin;
+    std::vector<size_t> block_of(program.size() + 1);
+    for (size_t i = 0; i < program.size(); ++i) {
+        if (is_leader[i]) {
+            begin.emplace_back(i);
+        }
+        block_of[i] = begin.size() - 1;
+    }
+    size_t blocks_count = begin.size();
+    block_of[program.size()] = blocks_count;
+    begin.emplace_back(program.size());
+
+    uint64_t taken_before = 0;
+    std::vector<size_t> fall_through(blocks_count, none);
+    std::vector<LayoutEdge> edges;
+    for (size_t block = 0; block < blocks_count; ++block) {
+        size_t last = begin[block + 1] - 1;
+        Command command = program[last].command;
+        if (command != JUMP && command != RET && command != END) {
+            uint64_t weight = command == CALL ? forced :
+                              IsConditionalJump(command) ? executed[last] - taken[last] : executed[last];
+            fall_through[block] = block + 1;
+            edges.push_back({weight, block, block + 1});
+        }
+        if (IsJump(command) && command != CALL) {
+            taken_before += taken[last];
+            // Placing the target of a jump that can not be inverted next saves nothing.
+            if (!IsConditionalJump(command) || InvertCondition(command) != command) {
+                edges.push_back({taken[last], block, block_of[JumpTarget(program[last])]});
+            }
+        }
+    }
+
+    std::stable_sort(edges.begin(), edges.end(), [](const LayoutEdge& lhs, const LayoutEdge& rhs) {
+        return lhs.weight > rhs.weight;
+    });
+    std::vector<size_t> chain_next(blocks_count, none);
+    std::vector<size_t> chain_prev(blocks_count, none);
+    for (const auto& edge : edges) {
+        bool is_cold_edge = edge.weight == 0 && executed[begin[edge.from]] != 0;
+        if (edge.to == blocks_count || edge.to == 0 || is_cold_edge ||
+            chain_next[edge.from] != none || chain_prev[edge.to] != none) {
+            continue;
+        }
+        size_t head = edge.from;
+        while (chain_prev[head] != none) {
+            head = chain_prev[head];
+        }
+        if (head != edge.to) {
+            chain_next[edge.from] = edge.to;
+            chain_prev[edge.to] = edge.from;
+        }
+    }
+
+    std::vector<size_t> heads;
+    for (size_t block = 0; block < blocks_count; ++block) {
+        if (chain_prev[block] == none) {
+            heads.emplace_back(block);
+        }
+    }
+    std::stable_sort(heads.begin() + 1, heads.end(), [&](size_t lhs, size_t rhs) {
+        return executed[begin[lhs]] != 0 && executed[begin[rhs]] == 0;
+    });
+    std::vector<size_t> order;
+    for (size_t head : heads) {
+        for (size_t block = head; block != none; block = chain_next[block]) {
+            order.emplace_back(block);
+        }
+    }
+
+    // Jump targets keep old indices until every block has its new position.
+    uint64_t taken_after = 0;
+    std::vector<size_t> new_begin(blocks_count + 1);
+    std::vector<Instruction> result;
+    result.reserve(program.size());
+    for (size_t position = 0; position < order.size(); ++position) {
+        size_t block = order[position];
+        size_t next = position + 1 < order.size() ? order[position + 1] : blocks_count;
+        new_begin[block] = result.size();
+        result.insert(result.end(), program.begin() + begin[block], program.begin() + begin[block + 1]);
+
+        Instruction& last = result.back();
+        uint64_t count = executed[begin[block + 1] - 1];
+        uint64_t jump_count = taken[begin[block + 1] - 1];
+        size_t follow = fall_through[block];
+        if (follow == none || follow == next) {
+            // A JUMP to the next block is removed by Optimize afterwards.
+            if (last.command != JUMP || block_of[JumpTarget(last)] != next) {
+                taken_after += jump_count;
+            }
+            continue;
+        }
+
+        if (IsConditionalJump(last.command) && block_of[JumpTarget(last)] == next &&
+            InvertCondition(last.command) != last.command) {
+            last.command = InvertCondition(last.command);
+            last.args.back() = static_cast<double>(begin[follow]);
+            taken_after += count - jump_count;
+            continue;
+        }
+
+        Instruction jump = last;
+        jump.command = JUMP;
+        jump.args = {static_cast<double>(begin[follow])};
+        result.emplace_back(jump);
+        taken_after += count;
+    }
+    new_begin[blocks_count] = result.size();
+
+    for (auto& instruction : result) {
+        if (IsJump(instruction.command)) {
+            instruction.args.back() = static_cast<double>(new_begin[block_of[JumpTarget(instruction)]]);
+        }
+    }
+    program.swap(result);
+    return {taken_before, taken_after};
+}
+
+void Optimize(std::vector<Instruction>& program, ValueType type) {
+    WithValueType(type, [&](auto zero) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            changed |= FoldConstants<decltype(zero)>(program);
+            changed |= ForwardStores(program);
+            changed |= ThreadJumps(program);
+            changed |= RemoveJumpsToNext(program);
+            changed |= RemoveUnreachableCode(program);
+        }
+    });
+}
+
+int main(int argc, char* argv[]) {
+    const std::string profile_option("--profile=");
+
+    std::string input_name;
+    std::string profile_name;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg.compare(0, profile_option.size(), profile_option) == 0) {
+            profile_name = arg.substr(profile_option.size());
+        } else if (input_name.empty()) {
+            input_name = arg;
+        } else {
+            input_name.clear();
+            break;
+        }
+    }
+
+    if (input_name.empty()) {
+        std::cout << "Invalid count of arguments.\n Enter name of input file [--profile=block.profile]\n";
+        return 0;
+    }
+    std::string output_name("a.o");
+
+    ObjectFile object;
+    if (ReadObject(input_name, &object) == -1) {
+        std::cout << "Invalid object file\n";
+        return 0;
+    }
+    // Optimization moves code around, which a module's symbols and relocations do not
+    // follow, so modules are optimized as a whole once they are linked.
+    if (object.flags & LINKABLE) {
+        std::cout << "Link " << input_name << " with dedld before optimizing it\n";
+        return 0;
+    }
+
+    size_t words_before = object.code.size();
+    std::vector<Instruction> program;
+    if (!DecodeProgram(object, &program) || !ConvertTargetsToIndices(program)) {
+        std::cout << "Optimization terminated\n";
+        return 0;
+    }
+    size_t instructions_before = program.size();
+
+    if (!profile_name.empty()) {
+        BlockProfile profile;
+        if (ReadBlockProfile(profile_name, words_before, &profile) == -1) {
+            std::cout << "Profile " << profile_name << " does not match " << input_name << "\n";
+            return 0;
+        }
+        std::vector<uint64_t> executed(program.size());
+        std::vector<uint64_t> taken(program.size());
+        for (size_t i = 0; i < program.size(); ++i) {
+            executed[i] = profile.executed[program[i].offset];
+            taken[i] = profile.taken[program[i].offset];
+        }
+        auto [taken_before, taken_after] = ReorderBlocks(program, executed, taken);
+        std::cout << "Taken jumps (profiled run): " << taken_before << " -> " << taken_after << "\n";
+    }
+
+    Optimize(program, GetValueType(object));
+    Relocate(program, &object);
+    if (WriteObject(output_name, object) == -1) {
+        std::cout << "Can not write " << output_name << "\n";
+        return 0;
+    }
+
+    std::cout << "Instructions: " << instructions_before << " -> " << program.size() << "\n";
+    std::cout << "Words: " << words_before << " -> " << object.code.size() << "\n";
+    return 0;
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+
+enum PerfEvent {
+    CYCLES,
+    INSTRUCTIONS,
+    BRANCH_MISSES,
+    L1D_MISSES,
+    LLC_MISSES,
+    PERF_EVENTS_COUNT
+};
+
+const char* perf_event_names[PERF_EVENTS_COUNT] = {
+        "cycles",
+        "instructions",
+        "branch-misses",
+        "L1d-read-misses",
+        "LLC-misses"
+};
+
+struct PerfValues {
+    uint64_t value[PERF_EVENTS_COUNT]{};
+    bool available[PERF_EVENTS_COUNT]{};
+};
+
+// One group of hardware counters of the calling thread, counting user space only.
+// Events the machine does not support are left out of the group; if cycles can not
+// be counted the group is not opened at all and Open() reports why.
+class PerfCounters {
+public:
+    bool Open(std::string* error) {
+        perf_event_attr attributes[PERF_EVENTS_COUNT];
+        for (auto& attribute : attributes) {
+            std::memset(&attribute, 0, sizeof(attribute));
+            attribute.size = sizeof(attribute);
+            attribute.exclude_kernel = 1;
+            attribute.exclude_hv = 1;
+            attribute.read_format = PERF_FORMAT_GROUP;
+        }
+        attributes[CYCLES].type = PERF_TYPE_HARDWARE;
+        attributes[CYCLES].config = PERF_COUNT_HW_CPU_CYCLES;
+        attributes[CYCLES].disabled = 1;
+        attributes[INSTRUCTIONS].type = PERF_TYPE_HARDWARE;
+        attributes[INSTRUCTIONS].config = PERF_COUNT_HW_INSTRUCTIONS;
+        attributes[BRANCH_MISSES].type = PERF_TYPE_HARDWARE;
+        attributes[BRANCH_MISSES].config = PERF_COUNT_HW_BRANCH_MISSES;
+        attributes[L1D_MISSES].type = PERF_TYPE_HW_CACHE;
+        attributes[L1D_MISSES].config = PERF_COUNT_HW_CACHE_L1D |
+                                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attributes[LLC_MISSES].type = PERF_TYPE_HARDWARE;
+        attributes[LLC_MISSES].config = PERF_COUNT_HW_CACHE_MISSES;
+
+        for (int event = 0; event < PERF_EVENTS_COUNT; ++event) {
+            int fd = OpenEvent(&attributes[event], event == CYCLES ? -1 : leader_);
+            if (event == CYCLES && fd == -1) {
+                *error = std::strerror(errno);
+                return false;
+            }
+            if (event == CYCLES) {
+                leader_ = fd;
+            }
+            if (fd != -1) {
+                fds_.emplace_back(fd);
+                events_.emplace_back(static_cast<PerfEvent>(event));
+            }
+        }
+        return true;
+    }
+
+    void Enable() {
+        ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    void Disable() {
+        ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    bool Read(PerfValues* values) {
+        uint64_t buffer[PERF_EVENTS_COUNT + 1];
+        if (read(leader_, buffer, sizeof(buffer)) == -1 || buffer[0] != events_.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < events_.size(); ++i) {
+            values->value[events_[i]] = buffer[i + 1];
+            values->available[events_[i]] = true;
+        }
+        return true;
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds_) {
+            close(fd);
+        }
+    }
+
+private:
+    static int OpenEvent(perf_event_attr* attribute, int group_fd) {
+        return static_cast<int>(syscall(SYS_perf_event_open, attribute, 0, -1, group_fd, 0));
+    }
+
+    int leader_ = -1;
+    std::vector<int> fds_;
+    std::vector<PerfEvent> events_;
+};
+
+PerfValues Difference(const PerfValues& after, const PerfValues& before) {
+    PerfValues difference;
+    for (int event = 0; event < PERF_EVENTS_COUNT; ++event) {
+        difference.available[event] = after.available[event];
+        difference.value[event] = after.value[event] - before.value[event];
+    }
+    return difference;
+}
+
+void PrintPerfValues(const PerfValues& values, uint64_t dispatches, std::ostream* out) {
+    for (int event = 0; event < PERF_EVENTS_COUNT; ++event) {
+        *out << std::setw(16) << perf_event_names[event] << ": ";
+        if (values.available[event]) {
+            *out << values.value[event] << "\n";
+        } else {
+            *out << "n/a\n";
+        }
+    }
+    if (values.value[CYCLES] != 0) {
+        *out << std::setw(16) << "IPC" << ": "
+             << static_cast<double>(values.value[INSTRUCTIONS]) / values.value[CYCLES] << "\n";
+    }
+    if (dispatches != 0 && values.available[BRANCH_MISSES]) {
+        *out << std::setw(16) << "misses/dispatch" << ": "
+             << static_cast<double>(values.value[BRANCH_MISSES]) / dispatches << "\n";
+    }
+}
+
+// Dispatch loop hook for the whole-run mode: only counts dispatched instructions.
+struct DispatchCounter {
+    void BeforeCommand(Command command, size_t offset) {
+    }
+
+    void AfterCommand(Command command, size_t offset) {
+        ++dispatches;
+    }
+
+    uint64_t dispatches = 0;
+};
+
+// Dispatch loop hook that enables the counters only while an instruction executes
+// and charges what they counted to its opcode. The cost of toggling the counters
+// is measured up front and subtracted from every sample.
+class OpcodeCounters {
+public:
+    explicit OpcodeCounters(PerfCounters* counters) : counters_(counters) {
+        Calibrate();
+    }
+
+    void BeforeCommand(Command command, size_t offset) {
+        counters_->Enable();
+    }
+
+    void AfterCommand(Command command, size_t offset) {
+        counters_->Disable();
+        PerfValues current;
+        counters_->Read(&current);
+        auto sample = Difference(current, last_);
+        last_ = current;
+
+        if (command >= per_opcode_.size()) {
+            per_opcode_.resize(command + 1);
+            dispatches_.resize(command + 1);
+        }
+        for (int event = 0; event < PERF_EVENTS_COUNT; ++event) {
+            uint64_t value = sample.value[event];
+            value = value > overhead_.value[event] ? value - overhead_.value[event] : 0;
+            per_opcode_[command].value[event] += value;
+            per_opcode_[command].available[event] = sample.available[event];
+        }
+        ++dispatches_[command];
+    }
+
+    void Print(std::ostream* out) const {
+        for (size_t command = 0; command < per_opcode_.size(); ++command) {
+            if (dispatches_[command] == 0) {
+                continue;
+            }
+            *out << CommandName(static_cast<Command>(command)) << " (" << dispatches_[command]
+                 << " dispatches)\n";
+            PrintPerfValues(per_opcode_[command], dispatches_[command], out);
+        }
+    }
+
+private:
+    void Calibrate() {
+        const int rounds = 1000;
+        counters_->Read(&last_);
+        PerfValues start = last_;
+        for (int i = 0; i < rounds; ++i) {
+            counters_->Enable();
+            counters_->Disable();
+        }
+        counters_->Read(&last_);
+        auto total = Difference(last_, start);
+        for (int event = 0; event < PERF_EVENTS_COUNT; ++event) {
+            overhead_.value[event] = total.value[event] / rounds;
+        }
+    }
+
+    PerfCounters* counters_;
+    PerfValues last_;
+    PerfValues overhead_;
+    std::vector<PerfValues> per_opcode_;
+    std::vector<uint64_t> dispatches_;
+};
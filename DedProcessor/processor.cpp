@@ -1,290 +1,161 @@
-#include <math.h>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <vector>
 
-#include "commands.h"
-#include "stack.h"
-#include "utils.h"
-
-struct ProcessorState {
-    size_t instruction_pointer = 0;
-
-    Stack<double> stack;
-    Stack<size_t> instruction_stack;
-
-    double ra = 0;
-    double rb = 0;
-    double rc = 0;
-    double rd = 0;
-
-    double memory[4096]{};
+#include "block_profile.h"
+#include "bytecode.h"
+#include "object.h"
+#include "perf_counters.h"
+#include "processor.h"
+#include "sampling_profiler.h"
+
+enum class PerfMode {
+    OFF,
+    TOTAL,
+    PER_OPCODE
 };
 
-template <class T>
-T ExtractOneElement(Stack<T>* stack) {
-    T element = stack->Top();
-    stack->Pop();
-    return element;
-}
+template <class Value>
+void RunWithPerfCounters(const std::vector<double>& buffer, ProcessorState<Value>* state, PerfMode mode) {
+    PerfCounters counters;
+    std::string error;
+    if (!counters.Open(&error)) {
+        std::cerr << "Hardware counters are unavailable (" << error << "), running without them\n";
+        RunProgram(buffer, state);
+        return;
+    }
 
-std::pair<double, double> ExtractTwoElements(Stack<double>* stack) {
-    double first = stack->Top();
-    stack->Pop();
-    double second = stack->Top();
-    stack->Pop();
-    return {second, first};
-}
+    std::cerr << "Engine: switch dispatch\n";
+    if (mode == PerfMode::PER_OPCODE) {
+        OpcodeCounters hook(&counters);
+        RunProgram(buffer, state, &hook);
+        hook.Print(&std::cerr);
+        return;
+    }
 
-void ExecuteAdd(ProcessorState* state) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    state->stack.Push(lhs + rhs);
+    DispatchCounter hook;
+    PerfValues before;
+    PerfValues after;
+    counters.Read(&before);
+    counters.Enable();
+    RunProgram(buffer, state, &hook);
+    counters.Disable();
+    counters.Read(&after);
+    std::cerr << "Dispatches: " << hook.dispatches << "\n";
+    PrintPerfValues(Difference(after, before), hook.dispatches, &std::cerr);
 }
 
-void ExecuteSub(ProcessorState* state) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    state->stack.Push(lhs - rhs);
-}
+template <class Value>
+void RunWithProfiler(const ObjectFile& object, ProcessorState<Value>* state) {
+    const long interval_us = 1000;
+    const std::string output_name("profile.folded");
 
-void ExecuteMul(ProcessorState* state) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    state->stack.Push(lhs * rhs);
-}
+    SamplingProfiler profiler(&object, state, interval_us);
+    profiler.Start();
+    RunProgram(object.code, state, &profiler);
+    profiler.Stop();
 
-void ExecuteDiv(ProcessorState* state) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    state->stack.Push(lhs / rhs);
+    std::ofstream output(output_name);
+    profiler.PrintCollapsed(&output);
+    std::cerr << profiler.SamplesCount() << " samples written to " << output_name << "\n";
 }
 
-void ExecuteSqrt(ProcessorState* state) {
-    auto number = ExtractOneElement(&state->stack);
-    state->stack.Push(std::sqrt(number));
-}
+template <class Value>
+void RunWithBlockProfiler(const ObjectFile& object, ProcessorState<Value>* state) {
+    const std::string output_name("block.profile");
 
-void ExecuteJump(ProcessorState* state, size_t arg) {
-    state->instruction_pointer = arg;
-}
+    BlockProfiler profiler(object.code.size(), state);
+    RunProgram(object.code, state, &profiler);
 
-void ExecuteJE(ProcessorState* state, size_t arg) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    if (lhs == rhs) {
-        state->instruction_pointer = arg;
+    if (WriteBlockProfile(output_name, profiler.Profile()) == -1) {
+        std::cerr << "Can not write " << output_name << "\n";
+        return;
     }
+    std::cerr << "Jumps: " << profiler.JumpsCount() << ", taken: " << profiler.TakenJumpsCount() << "\n";
+    std::cerr << "Block profile written to " << output_name << "\n";
 }
 
-void ExecuteJN(ProcessorState* state, size_t arg) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    if (lhs != rhs) {
-        state->instruction_pointer = arg;
+void ReportRuntimeError(const ObjectFile& object, const std::string& error, size_t offset) {
+    std::cerr << "Runtime error: " << error << " at offset " << offset;
+    const DebugEntry* entry = FindDebugEntry(object.debug, offset);
+    if (entry != nullptr) {
+        std::cerr << " (asm line " << entry->asm_line;
+        if (entry->source_line != 0) {
+            std::cerr << ", source line " << entry->source_line;
+        }
+        std::cerr << ")";
     }
+    std::cerr << "\n";
 }
 
-void ExecuteJL(ProcessorState* state, size_t arg) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    if (lhs < rhs) {
-        state->instruction_pointer = arg;
+int main(int argc, char* argv[]) {
+    std::string input_name;
+    bool print_heap_stats = false;
+    bool profile = false;
+    bool block_profile = false;
+    PerfMode perf_mode = PerfMode::OFF;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "--heap-stats") {
+            print_heap_stats = true;
+        } else if (arg == "--profile") {
+            profile = true;
+        } else if (arg == "--block-profile") {
+            block_profile = true;
+        } else if (arg == "--perf-counters") {
+            perf_mode = PerfMode::TOTAL;
+        } else if (arg == "--perf-counters=opcode") {
+            perf_mode = PerfMode::PER_OPCODE;
+        } else if (input_name.empty()) {
+            input_name = arg;
+        } else {
+            input_name.clear();
+            break;
+        }
     }
-}
 
-void ExecuteJG(ProcessorState* state, size_t arg) {
-    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
-    if (lhs > rhs) {
-        state->instruction_pointer = arg;
+    if (input_name.empty()) {
+        std::cout << "Invalid count of arguments.\n Enter name of input file "
+                     "[--heap-stats] [--perf-counters[=opcode]] [--profile] [--block-profile]\n";
+        return 0;
     }
-}
-
-void ExecutePush(ProcessorState* state, double arg) {
-    state->stack.Push(arg);
-}
-
-void ExecutePop(ProcessorState* state) {
-    state->stack.Pop();
-}
-
-void ExecuteMovSTOA(ProcessorState* state) {
-    double number = ExtractOneElement(&state->stack);
-    state->ra = number;
-}
-
-void ExecuteMovSTOB(ProcessorState* state) {
-    double number = ExtractOneElement(&state->stack);
-    state->rb = number;
-}
-
-void ExecuteMovSTOC(ProcessorState* state) {
-    double number = ExtractOneElement(&state->stack);
-    state->rc= number;
-}
-
-void ExecuteMovSTOD(ProcessorState* state) {
-    double number = ExtractOneElement(&state->stack);
-    state->rd = number;
-}
-
-void ExecuteMovSTOMEM(ProcessorState* state, size_t arg) {
-    double number = ExtractOneElement(&state->stack);
-    state->memory[arg] = number;
-}
-
-void ExecuteMovATOS(ProcessorState* state) {
-    state->stack.Push(state->ra);
-}
-
-void ExecuteMovBTOS(ProcessorState* state) {
-    state->stack.Push(state->rb);
-}
-
-void ExecuteMovCTOS(ProcessorState* state) {
-    state->stack.Push(state->rc);
-}
-
-void ExecuteMovDTOS(ProcessorState* state) {
-    state->stack.Push(state->rd);
-}
-
-void ExecuteMovMEMTOS(ProcessorState* state, size_t arg) {
-    state->stack.Push(state->memory[arg]);
-}
-
-void ExecuteIn(ProcessorState* state) {
-    double number = 0;
-    std::cin >> number;
-    state->stack.Push(number);
-}
 
-void ExecuteOut(ProcessorState* state) {
-    std::cout << state->stack.Top() << "\n";
-}
-
-void ExecuteCall(ProcessorState* state, size_t arg) {
-    state->instruction_stack.Push(state->instruction_pointer + 1);
-    state->instruction_pointer = arg;
-}
-
-void ExecuteRet(ProcessorState* state) {
-    state->instruction_pointer = ExtractOneElement(&state->instruction_stack);
-}
-
-void ExecuteEnd() {
-    exit(0);
-}
-
-void ExecuteCommand(Command command, const std::vector<double>& args, ProcessorState* state) {
-    switch (command) {
-        case ADD:
-            ExecuteAdd(state);
-            break;
-        case SUB:
-            ExecuteSub(state);
-            break;
-        case MUL:
-            ExecuteMul(state);
-            break;
-        case DIV:
-            ExecuteDiv(state);
-            break;
-        case SQRT:
-            ExecuteSqrt(state);
-            break;
-        case JUMP:
-            ExecuteJump(state, static_cast<size_t>(args[0]));
-            break;
-        case JE:
-            ExecuteJE(state, static_cast<size_t>(args[0]));
-            break;
-        case JN:
-            ExecuteJN(state, static_cast<size_t>(args[0]));
-            break;
-        case JL:
-            ExecuteJL(state, static_cast<size_t>(args[0]));
-            break;
-        case JG:
-            ExecuteJG(state, static_cast<size_t>(args[0]));
-            break;
-        case PUSH:
-            ExecutePush(state, args[0]);
-            break;
-        case POP:
-            ExecutePop(state);
-            break;
-        case MOV_STOA:
-            ExecuteMovSTOA(state);
-            break;
-        case MOV_STOB:
-            ExecuteMovSTOB(state);
-            break;
-        case MOV_STOC:
-            ExecuteMovSTOC(state);
-            break;
-        case MOV_STOD:
-            ExecuteMovSTOD(state);
-            break;
-        case MOV_STOMEM:
-            ExecuteMovSTOMEM(state, static_cast<size_t>(args[0]));
-            break;
-        case MOV_ATOS:
-            ExecuteMovATOS(state);
-            break;
-        case MOV_BTOS:
-            ExecuteMovBTOS(state);
-            break;
-        case MOV_CTOS:
-            ExecuteMovCTOS(state);
-            break;
-        case MOV_DTOS:
-            ExecuteMovDTOS(state);
-            break;
-        case MOV_MEMTOS:
-            ExecuteMovMEMTOS(state, static_cast<size_t>(args[0]));
-            break;
-        case IN:
-            ExecuteIn(state);
-            break;
-        case OUT:
-            ExecuteOut(state);
-            break;
-        case CALL:
-            ExecuteCall(state, static_cast<size_t>(args[0]));
-            break;
-        case RET:
-            ExecuteRet(state);
-            break;
-        case END:
-            ExecuteEnd();
-            break;
+    ObjectFile object;
+    if (ReadObject(input_name, &object) == -1) {
+        std::cout << "Invalid object file\n";
+        return 0;
     }
-}
-
-
-
-int main(int argc, char* argv[]) {
-    ProcessorState state;
-
-    if (argc != 2) {
-        std::cout << "Invalid count of arguments.\n Enter name of input file\n";
+    if (const Symbol* import = FindImport(object)) {
+        std::cout << "Unresolved symbol " << import->name << ", link the program with dedld\n";
         return 0;
     }
-
-    std::string input_name(argv[1]);
-
-    std::vector<double> buffer;
-    if (ReadFile(input_name, buffer) == -1) {
-        std::cout << "Invalid filename\n";
+    long long invalid_operand = FindInvalidOperand(object.code);
+    if (invalid_operand != -1) {
+        std::cout << "Invalid operand at offset " << invalid_operand << "\n";
         return 0;
     }
 
-    while(state.instruction_pointer < buffer.size()) {
-        Command command = static_cast<Command>(buffer[state.instruction_pointer]);
-        ++state.instruction_pointer;
-
-        std::vector<double> args;
-        if (HasOneArg(command)) {
-            args.emplace_back(buffer[state.instruction_pointer]);
-            ++state.instruction_pointer;
+    WithValueType(GetValueType(object), [&](auto zero) {
+        using Value = decltype(zero);
+        ProcessorState<Value> state;
+
+        if (profile) {
+            RunWithProfiler(object, &state);
+        } else if (block_profile) {
+            RunWithBlockProfiler(object, &state);
+        } else if (perf_mode != PerfMode::OFF) {
+            RunWithPerfCounters(object.code, &state, perf_mode);
+        } else {
+            RunProgram(object.code, &state);
+        }
+        if (state.error != nullptr) {
+            ReportRuntimeError(object, state.error, state.instruction_offset);
         }
 
-        ExecuteCommand(command, args, &state);
-    }
-
+        if (print_heap_stats) {
+            state.heap.PrintStats(&std::cerr);
+        }
+    });
     return 0;
-}
\ No newline at end of file
+}
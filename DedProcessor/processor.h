@@ -0,0 +1,668 @@
+#pragma once
+
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "commands.h"
+#include "guarded_memory.h"
+#include "heap.h"
+#include "object.h"
+#include "stack.h"
+
+// Value is the type of the stack, register and memory cells. Instruction operands
+// are always encoded as doubles and converted to Value when they are used as values.
+template <class Value>
+struct ProcessorState {
+    size_t instruction_pointer = 0;
+    // Offset of the instruction being executed, which is what a memory fault reports.
+    size_t instruction_offset = 0;
+
+    Stack<Value> stack;
+    Stack<size_t> instruction_stack;
+
+    // Registers 0..3 are the ra..rd of the MOV_STOx/MOV_xTOS instructions.
+    Value registers[REGISTERS_COUNT]{};
+
+    GuardedMemory<Value> memory{MEMORY_SIZE};
+    Heap heap{STATIC_MEMORY_SIZE, MEMORY_SIZE};
+
+    // Frames of ENTER/LEAVE, reserved up front so that calls never allocate: locals
+    // holds the cells of all open frames, frames the base and size of the ones below
+    // the current frame.
+    struct Frame {
+        size_t base;
+        size_t size;
+    };
+    std::vector<Value> locals = std::vector<Value>(FRAME_STACK_SIZE);
+    std::vector<Frame> frames = std::vector<Frame>(FRAMES_DEPTH);
+    size_t frames_count = 0;
+    Frame frame{0, 0};
+
+    bool halted = false;
+    // Set together with halted when the program stops on a runtime error.
+    const char* error = nullptr;
+
+    std::istream* in = &std::cin;
+    std::ostream* out = &std::cout;
+
+    // Brings a used state back to the one of a freshly started processor.
+    void Reset() {
+        instruction_pointer = 0;
+        instruction_offset = 0;
+        stack.Clear();
+        instruction_stack.Clear();
+        std::memset(registers, 0, sizeof(registers));
+        memory.Clear();
+        frames_count = 0;
+        frame = {0, 0};
+        heap = Heap(STATIC_MEMORY_SIZE, MEMORY_SIZE);
+        halted = false;
+        error = nullptr;
+    }
+};
+
+template <class T>
+T ExtractOneElement(Stack<T>* stack) {
+    T element = stack->Top();
+    stack->Pop();
+    return element;
+}
+
+template <class T>
+std::pair<T, T> ExtractTwoElements(Stack<T>* stack) {
+    T first = stack->Top();
+    stack->Pop();
+    T second = stack->Top();
+    stack->Pop();
+    return {second, first};
+}
+
+template <class Value>
+void ExecuteAdd(ProcessorState<Value>* state) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    state->stack.Push(lhs + rhs);
+}
+
+template <class Value>
+void ExecuteSub(ProcessorState<Value>* state) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    state->stack.Push(lhs - rhs);
+}
+
+template <class Value>
+void ExecuteMul(ProcessorState<Value>* state) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    state->stack.Push(lhs * rhs);
+}
+
+template <class Value>
+void ExecuteDiv(ProcessorState<Value>* state) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    state->stack.Push(lhs / rhs);
+}
+
+template <class Value>
+void ExecuteSqrt(ProcessorState<Value>* state) {
+    auto number = ExtractOneElement(&state->stack);
+    state->stack.Push(static_cast<Value>(std::sqrt(number)));
+}
+
+template <class Value>
+void ExecuteJump(ProcessorState<Value>* state, size_t arg) {
+    state->instruction_pointer = arg;
+}
+
+template <class Value>
+void ExecuteJE(ProcessorState<Value>* state, size_t arg) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    if (lhs == rhs) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteJN(ProcessorState<Value>* state, size_t arg) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    if (lhs != rhs) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteJL(ProcessorState<Value>* state, size_t arg) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    if (lhs < rhs) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteJG(ProcessorState<Value>* state, size_t arg) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    if (lhs > rhs) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteJGE(ProcessorState<Value>* state, size_t arg) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    if (!(lhs < rhs)) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteJLE(ProcessorState<Value>* state, size_t arg) {
+    auto [lhs, rhs] = ExtractTwoElements(&state->stack);
+    if (!(lhs > rhs)) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecutePush(ProcessorState<Value>* state, double arg) {
+    state->stack.Push(static_cast<Value>(arg));
+}
+
+template <class Value>
+void ExecutePop(ProcessorState<Value>* state) {
+    state->stack.Pop();
+}
+
+template <class Value>
+void ExecuteMovSTOA(ProcessorState<Value>* state) {
+    Value number = ExtractOneElement(&state->stack);
+    state->registers[0] = number;
+}
+
+template <class Value>
+void ExecuteMovSTOB(ProcessorState<Value>* state) {
+    Value number = ExtractOneElement(&state->stack);
+    state->registers[1] = number;
+}
+
+template <class Value>
+void ExecuteMovSTOC(ProcessorState<Value>* state) {
+    Value number = ExtractOneElement(&state->stack);
+    state->registers[2] = number;
+}
+
+template <class Value>
+void ExecuteMovSTOD(ProcessorState<Value>* state) {
+    Value number = ExtractOneElement(&state->stack);
+    state->registers[3] = number;
+}
+
+template <class Value>
+void ExecuteMovSTOMEM(ProcessorState<Value>* state, size_t arg) {
+    Value number = ExtractOneElement(&state->stack);
+    state->memory[arg] = number;
+}
+
+template <class Value>
+void ExecuteMovATOS(ProcessorState<Value>* state) {
+    state->stack.Push(state->registers[0]);
+}
+
+template <class Value>
+void ExecuteMovBTOS(ProcessorState<Value>* state) {
+    state->stack.Push(state->registers[1]);
+}
+
+template <class Value>
+void ExecuteMovCTOS(ProcessorState<Value>* state) {
+    state->stack.Push(state->registers[2]);
+}
+
+template <class Value>
+void ExecuteMovDTOS(ProcessorState<Value>* state) {
+    state->stack.Push(state->registers[3]);
+}
+
+template <class Value>
+void ExecuteMovMEMTOS(ProcessorState<Value>* state, size_t arg) {
+    state->stack.Push(state->memory[arg]);
+}
+
+template <class Value>
+void ExecuteIn(ProcessorState<Value>* state) {
+    Value number = 0;
+    *state->in >> number;
+    state->stack.Push(number);
+}
+
+template <class Value>
+void ExecuteOut(ProcessorState<Value>* state) {
+    *state->out << state->stack.Top() << "\n";
+}
+
+template <class Value>
+void ExecuteCall(ProcessorState<Value>* state, size_t arg) {
+    state->instruction_stack.Push(state->instruction_pointer);
+    state->instruction_pointer = arg;
+}
+
+template <class Value>
+void ExecuteRet(ProcessorState<Value>* state) {
+    state->instruction_pointer = ExtractOneElement(&state->instruction_stack);
+}
+
+template <class Value>
+void ExecuteDup(ProcessorState<Value>* state) {
+    state->stack.Push(state->stack.Top());
+}
+
+template <class Value>
+void ExecuteAlloc(ProcessorState<Value>* state, size_t arg) {
+    state->stack.Push(static_cast<Value>(state->heap.Allocate(arg)));
+}
+
+// The cell index of an address computed at runtime. Operands are checked when the
+// program is loaded, but a negative or NaN address, or one the memory does not cover,
+// only shows up here; it becomes the index of a cell in a guard page.
+template <class Value>
+size_t MemoryAddress(const ProcessorState<Value>& state, Value address) {
+    return address >= 0 && address < static_cast<Value>(state.memory.AddressesCount())
+               ? static_cast<size_t>(address)
+               : state.memory.GuardIndex();
+}
+
+template <class Value>
+void ExecuteFree(ProcessorState<Value>* state) {
+    state->heap.Free(MemoryAddress(*state, ExtractOneElement(&state->stack)));
+}
+
+template <class Value>
+void ExecuteArenaAlloc(ProcessorState<Value>* state, size_t arg) {
+    state->stack.Push(static_cast<Value>(state->heap.ArenaAllocate(arg)));
+}
+
+template <class Value>
+void ExecuteArenaReset(ProcessorState<Value>* state) {
+    state->heap.ArenaReset();
+}
+
+template <class Value>
+void ExecuteLoad(ProcessorState<Value>* state) {
+    size_t address = MemoryAddress(*state, ExtractOneElement(&state->stack));
+    state->stack.Push(state->memory[address]);
+}
+
+template <class Value>
+void ExecuteStore(ProcessorState<Value>* state) {
+    auto [value, address] = ExtractTwoElements(&state->stack);
+    state->memory[MemoryAddress(*state, address)] = value;
+}
+
+template <class Value>
+void ExecuteRAdd(ProcessorState<Value>* state, size_t result, size_t lhs, size_t rhs) {
+    state->registers[result] = state->registers[lhs] + state->registers[rhs];
+}
+
+template <class Value>
+void ExecuteRSub(ProcessorState<Value>* state, size_t result, size_t lhs, size_t rhs) {
+    state->registers[result] = state->registers[lhs] - state->registers[rhs];
+}
+
+template <class Value>
+void ExecuteRMul(ProcessorState<Value>* state, size_t result, size_t lhs, size_t rhs) {
+    state->registers[result] = state->registers[lhs] * state->registers[rhs];
+}
+
+template <class Value>
+void ExecuteRDiv(ProcessorState<Value>* state, size_t result, size_t lhs, size_t rhs) {
+    state->registers[result] = state->registers[lhs] / state->registers[rhs];
+}
+
+template <class Value>
+void ExecuteRSet(ProcessorState<Value>* state, size_t result, double value) {
+    state->registers[result] = static_cast<Value>(value);
+}
+
+template <class Value>
+void ExecuteRMov(ProcessorState<Value>* state, size_t result, size_t source) {
+    state->registers[result] = state->registers[source];
+}
+
+template <class Value>
+void ExecuteRLoad(ProcessorState<Value>* state, size_t result, size_t address) {
+    state->registers[result] = state->memory[address];
+}
+
+template <class Value>
+void ExecuteRStore(ProcessorState<Value>* state, size_t source, size_t address) {
+    state->memory[address] = state->registers[source];
+}
+
+template <class Value>
+void ExecuteRPush(ProcessorState<Value>* state, size_t source) {
+    state->stack.Push(state->registers[source]);
+}
+
+template <class Value>
+void ExecuteRPop(ProcessorState<Value>* state, size_t result) {
+    state->registers[result] = ExtractOneElement(&state->stack);
+}
+
+template <class Value>
+void ExecuteRJE(ProcessorState<Value>* state, size_t lhs, size_t rhs, size_t arg) {
+    if (state->registers[lhs] == state->registers[rhs]) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteRJN(ProcessorState<Value>* state, size_t lhs, size_t rhs, size_t arg) {
+    if (state->registers[lhs] != state->registers[rhs]) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteRJL(ProcessorState<Value>* state, size_t lhs, size_t rhs, size_t arg) {
+    if (state->registers[lhs] < state->registers[rhs]) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteRJG(ProcessorState<Value>* state, size_t lhs, size_t rhs, size_t arg) {
+    if (state->registers[lhs] > state->registers[rhs]) {
+        state->instruction_pointer = arg;
+    }
+}
+
+template <class Value>
+void ExecuteEnd(ProcessorState<Value>* state) {
+    state->halted = true;
+}
+
+template <class Value>
+void StopOnError(ProcessorState<Value>* state, const char* error) {
+    state->error = error;
+    state->halted = true;
+}
+
+// The frame stack is only checked here and in LEAVE, once per call: local accesses
+// are checked against the size of the current frame.
+template <class Value>
+void ExecuteEnter(ProcessorState<Value>* state, size_t size) {
+    size_t base = state->frame.base + state->frame.size;
+    if (state->frames_count == FRAMES_DEPTH || size > FRAME_STACK_SIZE - base) {
+        StopOnError(state, "frame stack overflow");
+        return;
+    }
+    state->frames[state->frames_count] = state->frame;
+    ++state->frames_count;
+    state->frame = {base, size};
+    std::fill(state->locals.begin() + base, state->locals.begin() + base + size, Value());
+}
+
+template <class Value>
+void ExecuteLeave(ProcessorState<Value>* state) {
+    if (state->frames_count == 0) {
+        StopOnError(state, "LEAVE without ENTER");
+        return;
+    }
+    --state->frames_count;
+    state->frame = state->frames[state->frames_count];
+}
+
+template <class Value>
+void ExecuteLoadLocal(ProcessorState<Value>* state, size_t index) {
+    if (index >= state->frame.size) {
+        StopOnError(state, "local outside of the frame");
+        return;
+    }
+    state->stack.Push(state->locals[state->frame.base + index]);
+}
+
+template <class Value>
+void ExecuteStoreLocal(ProcessorState<Value>* state, size_t index) {
+    if (index >= state->frame.size) {
+        StopOnError(state, "local outside of the frame");
+        return;
+    }
+    state->locals[state->frame.base + index] = ExtractOneElement(&state->stack);
+}
+
+template <class Value>
+void ExecuteCommand(Command command, const double* args, ProcessorState<Value>* state) {
+    switch (command) {
+        case ADD:
+            ExecuteAdd(state);
+            break;
+        case SUB:
+            ExecuteSub(state);
+            break;
+        case MUL:
+            ExecuteMul(state);
+            break;
+        case DIV:
+            ExecuteDiv(state);
+            break;
+        case SQRT:
+            ExecuteSqrt(state);
+            break;
+        case JUMP:
+            ExecuteJump(state, static_cast<size_t>(args[0]));
+            break;
+        case JE:
+            ExecuteJE(state, static_cast<size_t>(args[0]));
+            break;
+        case JN:
+            ExecuteJN(state, static_cast<size_t>(args[0]));
+            break;
+        case JL:
+            ExecuteJL(state, static_cast<size_t>(args[0]));
+            break;
+        case JG:
+            ExecuteJG(state, static_cast<size_t>(args[0]));
+            break;
+        case JGE:
+            ExecuteJGE(state, static_cast<size_t>(args[0]));
+            break;
+        case JLE:
+            ExecuteJLE(state, static_cast<size_t>(args[0]));
+            break;
+        case PUSH:
+            ExecutePush(state, args[0]);
+            break;
+        case POP:
+            ExecutePop(state);
+            break;
+        case MOV_STOA:
+            ExecuteMovSTOA(state);
+            break;
+        case MOV_STOB:
+            ExecuteMovSTOB(state);
+            break;
+        case MOV_STOC:
+            ExecuteMovSTOC(state);
+            break;
+        case MOV_STOD:
+            ExecuteMovSTOD(state);
+            break;
+        case MOV_STOMEM:
+            ExecuteMovSTOMEM(state, static_cast<size_t>(args[0]));
+            break;
+        case MOV_ATOS:
+            ExecuteMovATOS(state);
+            break;
+        case MOV_BTOS:
+            ExecuteMovBTOS(state);
+            break;
+        case MOV_CTOS:
+            ExecuteMovCTOS(state);
+            break;
+        case MOV_DTOS:
+            ExecuteMovDTOS(state);
+            break;
+        case MOV_MEMTOS:
+            ExecuteMovMEMTOS(state, static_cast<size_t>(args[0]));
+            break;
+        case IN:
+            ExecuteIn(state);
+            break;
+        case OUT:
+            ExecuteOut(state);
+            break;
+        case CALL:
+            ExecuteCall(state, static_cast<size_t>(args[0]));
+            break;
+        case RET:
+            ExecuteRet(state);
+            break;
+        case END:
+            ExecuteEnd(state);
+            break;
+        case DUP:
+            ExecuteDup(state);
+            break;
+        case ALLOC:
+            ExecuteAlloc(state, static_cast<size_t>(args[0]));
+            break;
+        case FREE:
+            ExecuteFree(state);
+            break;
+        case ARENA_ALLOC:
+            ExecuteArenaAlloc(state, static_cast<size_t>(args[0]));
+            break;
+        case ARENA_RESET:
+            ExecuteArenaReset(state);
+            break;
+        case LOAD:
+            ExecuteLoad(state);
+            break;
+        case STORE:
+            ExecuteStore(state);
+            break;
+        case RADD:
+            ExecuteRAdd(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                        static_cast<size_t>(args[2]));
+            break;
+        case RSUB:
+            ExecuteRSub(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                        static_cast<size_t>(args[2]));
+            break;
+        case RMUL:
+            ExecuteRMul(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                        static_cast<size_t>(args[2]));
+            break;
+        case RDIV:
+            ExecuteRDiv(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                        static_cast<size_t>(args[2]));
+            break;
+        case RSET:
+            ExecuteRSet(state, static_cast<size_t>(args[0]), args[1]);
+            break;
+        case RMOV:
+            ExecuteRMov(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]));
+            break;
+        case RLOAD:
+            ExecuteRLoad(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]));
+            break;
+        case RSTORE:
+            ExecuteRStore(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]));
+            break;
+        case RPUSH:
+            ExecuteRPush(state, static_cast<size_t>(args[0]));
+            break;
+        case RPOP:
+            ExecuteRPop(state, static_cast<size_t>(args[0]));
+            break;
+        case RJE:
+            ExecuteRJE(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                       static_cast<size_t>(args[2]));
+            break;
+        case RJN:
+            ExecuteRJN(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                       static_cast<size_t>(args[2]));
+            break;
+        case RJL:
+            ExecuteRJL(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                       static_cast<size_t>(args[2]));
+            break;
+        case RJG:
+            ExecuteRJG(state, static_cast<size_t>(args[0]), static_cast<size_t>(args[1]),
+                       static_cast<size_t>(args[2]));
+            break;
+        case ENTER:
+            ExecuteEnter(state, static_cast<size_t>(args[0]));
+            break;
+        case LEAVE:
+            ExecuteLeave(state);
+            break;
+        case LOAD_LOCAL:
+            ExecuteLoadLocal(state, static_cast<size_t>(args[0]));
+            break;
+        case STORE_LOCAL:
+            ExecuteStoreLocal(state, static_cast<size_t>(args[0]));
+            break;
+        // Directives steer the assembler and are never written to the code.
+        case LABEL:
+        case LINE:
+        case EXPORT:
+        case IMPORT:
+            StopOnError(state, "unknown command");
+            break;
+    }
+}
+
+// Observer of the dispatch loop that does nothing: RunProgram instantiated with it
+// is the plain interpreter, so diagnostics cost nothing when they are off.
+struct NoHook {
+    void BeforeCommand(Command command, size_t offset) {
+    }
+
+    void AfterCommand(Command command, size_t offset) {
+    }
+};
+
+template <class Value, class Hook>
+void RunInstructions(const std::vector<double>& buffer, ProcessorState<Value>* state, Hook* hook) {
+    while (!state->halted && state->instruction_pointer < buffer.size()) {
+        size_t offset = state->instruction_pointer;
+        Command command = static_cast<Command>(buffer[state->instruction_pointer]);
+        ++state->instruction_pointer;
+
+        // Nothing here owns heap memory: a memory fault leaves the loop with siglongjmp,
+        // which skips destructors.
+        double args[MAX_ARGS_COUNT] = {};
+        for (size_t i = 0; i < ArgsCount(command) && state->instruction_pointer < buffer.size(); ++i) {
+            args[i] = buffer[state->instruction_pointer];
+            ++state->instruction_pointer;
+        }
+
+        state->instruction_offset = offset;
+        // Keeps the store above ahead of the instruction's memory accesses for the
+        // guard page fault handler.
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+
+        hook->BeforeCommand(command, offset);
+        ExecuteCommand(command, args, state);
+        hook->AfterCommand(command, offset);
+    }
+}
+
+// Runs code whose operands passed FindInvalidOperand. An access to a guard page of the
+// memory abandons the dispatch loop and stops the program like any other runtime error.
+template <class Value, class Hook>
+void RunProgram(const std::vector<double>& buffer, ProcessorState<Value>* state, Hook* hook) {
+    if (!RunWithMemoryGuard(state->memory, [&] { RunInstructions(buffer, state, hook); })) {
+        StopOnError(state, "memory access out of bounds");
+    }
+}
+
+template <class Value>
+void RunProgram(const std::vector<double>& buffer, ProcessorState<Value>* state) {
+    NoHook hook;
+    RunProgram(buffer, state, &hook);
+}
+
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <string>
+
+// Wire protocol of the execution server. Every request starts with one byte of
+// RequestType, integers are sent in host byte order (the socket is local).
+//
+// PUT_PROGRAM: u64 size, object bytes -> u8 ReplyStatus, then u64 program hash if it
+//              is REPLY_OK
+// RUN:         u64 program hash, u64 input size, input bytes ->
+//              u8 ReplyStatus, then output as frames of u32 length and bytes,
+//              terminated by a frame of length 0
+//
+// A program larger than MAX_PROGRAM_SIZE or an input larger than MAX_INPUT_SIZE is
+// refused with its status before the bytes are read, and the server closes the
+// connection after the reply.
+enum RequestType : uint8_t {
+    PUT_PROGRAM = 'P',
+    RUN = 'R'
+};
+
+enum ReplyStatus : uint8_t {
+    REPLY_OK = 0,
+    UNKNOWN_PROGRAM = 1,
+    INVALID_PROGRAM = 2,
+    PROGRAM_TOO_LARGE = 3,
+    INPUT_TOO_LARGE = 4
+};
+
+const uint64_t MAX_PROGRAM_SIZE = uint64_t{64} << 20;
+const uint64_t MAX_INPUT_SIZE = uint64_t{16} << 20;
+
+const char* ReplyStatusMessage(uint8_t status) {
+    switch (status) {
+        case REPLY_OK:
+            return "ok";
+        case UNKNOWN_PROGRAM:
+            return "unknown program";
+        case INVALID_PROGRAM:
+            return "invalid or unlinked object file";
+        case PROGRAM_TOO_LARGE:
+            return "program is too large";
+        case INPUT_TOO_LARGE:
+            return "input is too large";
+    }
+    return "unknown status";
+}
+
+uint64_t HashBytes(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+bool ReadAll(int fd, void* data, size_t size) {
+    char* cur = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t count = read(fd, cur, size);
+        if (count <= 0) {
+            return false;
+        }
+        cur += count;
+        size -= count;
+    }
+    return true;
+}
+
+bool WriteAll(int fd, const void* data, size_t size) {
+    const char* cur = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t count = write(fd, cur, size);
+        if (count <= 0) {
+            return false;
+        }
+        cur += count;
+        size -= count;
+    }
+    return true;
+}
+
+template <class T>
+bool ReadValue(int fd, T* value) {
+    return ReadAll(fd, value, sizeof(T));
+}
+
+template <class T>
+bool WriteValue(int fd, T value) {
+    return WriteAll(fd, &value, sizeof(T));
+}
+
+bool FillSocketAddress(const std::string& path, sockaddr_un* address) {
+    if (path.size() >= sizeof(address->sun_path)) {
+        return false;
+    }
+    std::memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    std::memcpy(address->sun_path, path.data(), path.size());
+    return true;
+}
+
+// Output stream buffer that sends everything written to it as length-prefixed
+// frames, so the client sees output while the program is still running.
+class FrameStreamBuf : public std::streambuf {
+public:
+    explicit FrameStreamBuf(int fd) : fd_(fd) {
+        setp(buffer_, buffer_ + sizeof(buffer_));
+    }
+
+    bool Finish() {
+        return SendFrame() && WriteValue<uint32_t>(fd_, 0);
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        if (!SendFrame()) {
+            return traits_type::eof();
+        }
+        if (c != traits_type::eof()) {
+            *pptr() = static_cast<char>(c);
+            pbump(1);
+        }
+        return c;
+    }
+
+    int sync() override {
+        return SendFrame() ? 0 : -1;
+    }
+
+private:
+    bool SendFrame() {
+        auto size = static_cast<uint32_t>(pptr() - pbase());
+        if (size == 0) {
+            return true;
+        }
+        setp(buffer_, buffer_ + sizeof(buffer_));
+        return WriteValue(fd_, size) && WriteAll(fd_, buffer_, size);
+    }
+
+    int fd_;
+    char buffer_[4096];
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/time.h>
+#include <csignal>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "object.h"
+#include "processor.h"
+
+volatile sig_atomic_t sample_requested = 0;
+
+void RequestSample(int) {
+    sample_requested = 1;
+}
+
+// Dispatch loop hook that walks the CALL return stack whenever the SIGPROF timer
+// has fired and counts the resulting call stacks in collapsed form
+// ("frame;frame;frame count" per line), the input format of flamegraph tools.
+template <class State>
+class SamplingProfiler {
+public:
+    SamplingProfiler(const ObjectFile* object, const State* state, long interval_us)
+        : object_(object), state_(state), interval_us_(interval_us) {
+    }
+
+    void Start() {
+        std::signal(SIGPROF, RequestSample);
+        itimerval timer{};
+        timer.it_interval.tv_usec = interval_us_;
+        timer.it_value.tv_usec = interval_us_;
+        setitimer(ITIMER_PROF, &timer, nullptr);
+    }
+
+    void Stop() {
+        itimerval timer{};
+        setitimer(ITIMER_PROF, &timer, nullptr);
+        std::signal(SIGPROF, SIG_DFL);
+    }
+
+    void BeforeCommand(Command command, size_t offset) {
+        if (sample_requested) {
+            sample_requested = 0;
+            TakeSample(offset);
+        }
+    }
+
+    void AfterCommand(Command command, size_t offset) {
+    }
+
+    void PrintCollapsed(std::ostream* out) const {
+        for (const auto& [stack, count] : samples_) {
+            *out << stack << " " << count << "\n";
+        }
+    }
+
+    size_t SamplesCount() const {
+        size_t count = 0;
+        for (const auto& sample : samples_) {
+            count += sample.second;
+        }
+        return count;
+    }
+
+private:
+    void TakeSample(size_t offset) {
+        std::string stack = "main";
+        const auto& return_stack = state_->instruction_stack;
+        for (size_t i = 0; i < return_stack.Size(); ++i) {
+            // Every return address follows a two-word CALL whose argument is the callee.
+            size_t return_address = return_stack.At(i);
+            if (return_address >= 2 && return_address <= object_->code.size()) {
+                auto callee = static_cast<size_t>(object_->code[return_address - 1]);
+                stack += ";fn@" + DescribeOffset(callee);
+            }
+        }
+        stack += ";" + DescribeOffset(offset);
+        ++samples_[stack];
+    }
+
+    std::string DescribeOffset(size_t offset) const {
+        const DebugEntry* entry = FindDebugEntry(object_->debug, offset);
+        if (entry == nullptr) {
+            return "offset:" + std::to_string(offset);
+        }
+        std::string description = "asm:" + std::to_string(entry->asm_line);
+        if (entry->source_line != 0) {
+            description = "src:" + std::to_string(entry->source_line) + "/" + description;
+        }
+        return description;
+    }
+
+    const ObjectFile* object_;
+    const State* state_;
+    long interval_us_;
+    std::map<std::string, size_t> samples_;
+};
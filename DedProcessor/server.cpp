@@ -0,0 +1,229 @@
+#include <csignal>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode.h"
+#include "object.h"
+#include "processor.h"
+#include "protocol.h"
+
+// Programs already sent by clients, keyed by the hash of their object bytes and
+// evicted in least recently used order.
+class ProgramCache {
+public:
+    explicit ProgramCache(size_t capacity) : capacity_(capacity) {
+    }
+
+    std::shared_ptr<const ObjectFile> Find(uint64_t hash) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto found = position_by_hash_.find(hash);
+        if (found == position_by_hash_.end()) {
+            return nullptr;
+        }
+        entries_.splice(entries_.begin(), entries_, found->second);
+        return found->second->second;
+    }
+
+    void Insert(uint64_t hash, std::shared_ptr<const ObjectFile> program) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        auto found = position_by_hash_.find(hash);
+        if (found != position_by_hash_.end()) {
+            entries_.splice(entries_.begin(), entries_, found->second);
+            return;
+        }
+
+        entries_.emplace_front(hash, std::move(program));
+        position_by_hash_[hash] = entries_.begin();
+        if (entries_.size() > capacity_) {
+            position_by_hash_.erase(entries_.back().first);
+            entries_.pop_back();
+        }
+    }
+
+private:
+    using Entry = std::pair<uint64_t, std::shared_ptr<const ObjectFile>>;
+
+    size_t capacity_;
+    std::mutex mutex_;
+    std::list<Entry> entries_;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> position_by_hash_;
+};
+
+// Processor states are large, so they are allocated once and reused between runs.
+template <class Value>
+class StatePool {
+public:
+    explicit StatePool(size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            states_.emplace_back(std::make_unique<ProcessorState<Value>>());
+        }
+    }
+
+    std::unique_ptr<ProcessorState<Value>> Acquire() {
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (!states_.empty()) {
+                auto state = std::move(states_.back());
+                states_.pop_back();
+                return state;
+            }
+        }
+        return std::make_unique<ProcessorState<Value>>();
+    }
+
+    void Release(std::unique_ptr<ProcessorState<Value>> state) {
+        state->Reset();
+        std::lock_guard<std::mutex> guard(mutex_);
+        states_.emplace_back(std::move(state));
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<ProcessorState<Value>>> states_;
+};
+
+// Most programs compute in doubles, so only their pool is filled up front; states for
+// the other value types are allocated by the first runs that need them.
+class StatePools {
+public:
+    explicit StatePools(size_t size) : pools_(size, 0, 0, 0) {
+    }
+
+    template <class Value>
+    StatePool<Value>* Get() {
+        return &std::get<StatePool<Value>>(pools_);
+    }
+
+private:
+    std::tuple<StatePool<double>, StatePool<float>, StatePool<int64_t>, StatePool<long double>> pools_;
+};
+
+bool HandlePutProgram(int fd, ProgramCache* cache) {
+    uint64_t size = 0;
+    if (!ReadValue(fd, &size)) {
+        return false;
+    }
+    // The bytes of a refused request are left unread, so the connection can not go on.
+    if (size > MAX_PROGRAM_SIZE) {
+        WriteValue(fd, PROGRAM_TOO_LARGE);
+        return false;
+    }
+    std::vector<char> bytes(size);
+    if (!ReadAll(fd, bytes.data(), bytes.size())) {
+        return false;
+    }
+
+    uint64_t hash = HashBytes(bytes.data(), bytes.size());
+    ObjectFile object;
+    if (ParseObject(bytes.data(), bytes.size(), &object) == -1 || FindImport(object) != nullptr ||
+        FindInvalidOperand(object.code) != -1) {
+        return WriteValue(fd, INVALID_PROGRAM);
+    }
+    cache->Insert(hash, std::make_shared<ObjectFile>(std::move(object)));
+    return WriteValue(fd, REPLY_OK) && WriteValue(fd, hash);
+}
+
+bool HandleRun(int fd, ProgramCache* cache, StatePools* pools) {
+    uint64_t hash = 0;
+    uint64_t input_size = 0;
+    if (!ReadValue(fd, &hash) || !ReadValue(fd, &input_size)) {
+        return false;
+    }
+    if (input_size > MAX_INPUT_SIZE) {
+        WriteValue(fd, INPUT_TOO_LARGE);
+        WriteValue<uint32_t>(fd, 0);
+        return false;
+    }
+    std::string input(input_size, '\0');
+    if (!ReadAll(fd, &input[0], input.size())) {
+        return false;
+    }
+
+    auto program = cache->Find(hash);
+    if (program == nullptr) {
+        return WriteValue(fd, UNKNOWN_PROGRAM) && WriteValue<uint32_t>(fd, 0);
+    }
+    if (!WriteValue(fd, REPLY_OK)) {
+        return false;
+    }
+
+    std::istringstream in(input);
+    FrameStreamBuf output_buffer(fd);
+    std::ostream out(&output_buffer);
+
+    WithValueType(GetValueType(*program), [&](auto zero) {
+        auto* pool = pools->Get<decltype(zero)>();
+        auto state = pool->Acquire();
+        state->in = &in;
+        state->out = &out;
+        RunProgram(program->code, state.get());
+        if (state->error != nullptr) {
+            out << "Runtime error: " << state->error << " at offset " << state->instruction_offset << "\n";
+        }
+        pool->Release(std::move(state));
+    });
+
+    out.flush();
+    return output_buffer.Finish();
+}
+
+void ServeClient(int fd, ProgramCache* cache, StatePools* pools) {
+    uint8_t type = 0;
+    bool is_ok = true;
+    while (is_ok && ReadValue(fd, &type)) {
+        if (type == PUT_PROGRAM) {
+            is_ok = HandlePutProgram(fd, cache);
+        } else if (type == RUN) {
+            is_ok = HandleRun(fd, cache, pools);
+        } else {
+            is_ok = false;
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2 && argc != 4) {
+        std::cout << "Invalid count of arguments.\n Enter socket path [cache capacity, pool size]\n";
+        return 0;
+    }
+
+    std::string socket_path(argv[1]);
+    size_t cache_capacity = argc == 4 ? std::stoul(argv[2]) : 64;
+    size_t pool_size = argc == 4 ? std::stoul(argv[3]) : 4;
+
+    sockaddr_un address;
+    if (!FillSocketAddress(socket_path, &address)) {
+        std::cout << "Socket path is too long\n";
+        return 0;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path.data());
+    if (listener == -1 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 ||
+        listen(listener, 64) == -1) {
+        std::cout << "Can not listen on " << socket_path << ": " << std::strerror(errno) << "\n";
+        return 0;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    ProgramCache cache(cache_capacity);
+    StatePools pools(pool_size);
+    std::cout << "Listening on " << socket_path << "\n";
+
+    while (true) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd == -1) {
+            continue;
+        }
+        std::thread(ServeClient, fd, &cache, &pools).detach();
+    }
+}
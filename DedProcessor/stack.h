@@ -58,6 +58,17 @@ public:
         Update();
     }
 
+    void Clear() {
+        CheckState();
+        top_ = 0;
+        Reallocate(1);
+    }
+
+    // Element at index counted from the bottom of the stack.
+    T At(size_t index) const {
+        return items_[index];
+    }
+
     size_t Size() const {
         return top_;
     }
@@ -108,22 +119,26 @@ private:
 
     void CopyItems(ReasonForCopy reason) {
         CheckState();
-        T* new_items = nullptr;
         switch (reason) {
             case ReasonForCopy::EXPAND:
-                area_size_ <<= 1;
+                Reallocate(area_size_ << 1);
                 break;
             case ReasonForCopy::TIGHTEN:
-                area_size_ >>= 1;
+                Reallocate(area_size_ >> 1);
                 break;
         }
+    }
+
+    void Reallocate(size_t area_size) {
+        area_size_ = area_size;
 
         char* old_area = (char*)left_canary_;
-        char* area = (char*)std::calloc(sizeof(T) * area_size_ + 2 * sizeof(int), sizeof(char));
+        char* area = (char*)std::calloc(sizeof(T) * area_size_ + 3 * sizeof(int), sizeof(char));
 
         left_canary_ = (int*)area;
-        new_items = (T*)(area + sizeof(int));
-        right_canary_ = (int*)(area + sizeof(int) + sizeof(T) * area_size_);
+        T* new_items = (T*)(area + sizeof(int));
+        check_sum_ = (int*)(area + sizeof(int) + sizeof(T) * area_size_);
+        right_canary_ = (int*)(area + 2 * sizeof(int) + sizeof(T) * area_size_);
 
         for (size_t i = 0; i < top_; ++i) {
             new_items[i] = items_[i];
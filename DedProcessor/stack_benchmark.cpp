@@ -0,0 +1,90 @@
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrent_stack.h"
+#include "stack.h"
+
+// The single-threaded Stack behind one mutex, the baseline ConcurrentStack is
+// measured against.
+template <class T>
+class MutexStack {
+public:
+    void Push(T item) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stack_.Push(item);
+    }
+
+    bool TryPop(T* item) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (stack_.Empty()) {
+            return false;
+        }
+        *item = stack_.Top();
+        stack_.Pop();
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    Stack<T> stack_;
+};
+
+// Every thread pushes two items and pops two items per round, all threads start
+// together. Returns millions of operations per second over all threads.
+template <class SharedStack>
+double MeasureThroughput(size_t threads_count, size_t rounds) {
+    SharedStack stack;
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> start{false};
+
+    std::vector<std::thread> threads;
+    for (size_t thread = 0; thread < threads_count; ++thread) {
+        threads.emplace_back([&, thread] {
+            ++ready;
+            while (!start.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            size_t item = 0;
+            for (size_t round = 0; round < rounds; ++round) {
+                stack.Push(thread + round);
+                stack.Push(thread);
+                stack.TryPop(&item);
+                stack.TryPop(&item);
+            }
+        });
+    }
+    while (ready.load() != threads_count) {
+        std::this_thread::yield();
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    return 4.0 * rounds * threads_count / seconds / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 2) {
+        std::cout << "Invalid count of arguments.\n Enter [rounds per thread]\n";
+        return 0;
+    }
+    size_t rounds = argc == 2 ? std::stoul(argv[1]) : 100000;
+
+    std::cout << "threads  lock-free Mops/s  mutex Mops/s\n";
+    for (size_t threads_count = 1; threads_count <= 64; threads_count *= 2) {
+        double lock_free = MeasureThroughput<ConcurrentStack<size_t>>(threads_count, rounds);
+        double mutex = MeasureThroughput<MutexStack<size_t>>(threads_count, rounds);
+        std::cout << std::setw(7) << threads_count << std::setw(19) << std::fixed << std::setprecision(2)
+                  << lock_free << std::setw(14) << mutex << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Usage: aot_test.sh <directory with the tools> <assembler source>
+# Runs the program in the processor and as a dedaot build, their outputs and runtime
+# errors must match. A program the processor refuses to load dedaot must refuse too.
+set -e
+tools=$(cd "$1" && pwd)
+source=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+"$tools/assembler" "$source" -o program.o > /dev/null
+test -f program.o
+"$tools/processor" program.o < /dev/null > expected.txt 2> expected_errors.txt
+"$tools/dedaot" program.o --build > translation.txt
+if grep -q "^Invalid operand" expected.txt; then
+    grep -q "^Invalid operand" translation.txt
+    test ! -e a.out
+    exit 0
+fi
+test -x a.out
+./a.out < /dev/null > actual.txt 2> actual_errors.txt || true
+diff expected.txt actual.txt
+# The processor also names the assembler line of the error.
+sed 's/ (asm line.*)$//' expected_errors.txt | diff - actual_errors.txt
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <string>
 
 template <class Container>
@@ -32,4 +35,57 @@ int ReadFile(std::string filename, Container &buffer) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Read-only mapping of a whole file, for tools that stream over large inputs
+// without copying them.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    int Open(const std::string& filename) {
+        int fd = open(filename.data(), O_RDONLY);
+        if (fd == -1) {
+            return -1;
+        }
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) == -1) {
+            close(fd);
+            return -1;
+        }
+
+        size_ = statbuf.st_size;
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                size_ = 0;
+                return -1;
+            }
+            data_ = static_cast<const char*>(data);
+            madvise(data, size_, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        return 0;
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    ~MappedFile() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};